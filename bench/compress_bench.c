@@ -0,0 +1,181 @@
+// compress_bench.c
+// Compression ratio and throughput per codec on compressible (log/CSV-like)
+// and incompressible (random) inputs, to show where compression stops paying off.
+// The transfer table then sends WRITE requests through the real message
+// framing, so the cutoff reflects bytes actually put on the wire.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "../src/common/compress.h"
+#include "../src/common/utils.h"
+
+#define MAX_INPUT (64 * 1024)
+#define TARGET_BYTES (8 * 1024 * 1024) // processed per measurement
+#define LINK_BYTES_PER_SEC (100e6 / 8)  // modelled 100 Mbit/s network
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill_log(char *buf, int len) {
+    static const char *levels[] = {"INFO", "WARN", "DEBUG", "ERROR"};
+    int pos = 0;
+    for (int i = 0; pos < len; i++) {
+        char line[128];
+        int n = snprintf(line, sizeof(line),
+                         "2024-05-%02d 12:%02d:%02d,%s,storage_server,req=%d,bytes=%d\n",
+                         1 + i % 28, i % 60, (i * 7) % 60, levels[rand() % 4],
+                         rand() % 100000, rand() % 4096);
+        if (n > len - pos) n = len - pos;
+        memcpy(buf + pos, line, n);
+        pos += n;
+    }
+}
+
+static void fill_random(char *buf, int len) {
+    for (int i = 0; i < len; i++) buf[i] = (char)(rand() & 0xff);
+}
+
+typedef struct {
+    const char *name;
+    CompressionType type;
+    int level;
+} Codec;
+
+static void run(const char *input_name, const char *src, int len, const Codec *codec) {
+    CompressionType type = codec->type;
+    static char packed[MAX_INPUT * 2];
+    static char raw[MAX_INPUT];
+    int iterations = TARGET_BYTES / len;
+
+    int packed_len = compress_block(type, codec->level, src, len, packed, sizeof(packed));
+    double t0 = now_sec();
+    for (int i = 0; i < iterations; i++) {
+        compress_block(type, codec->level, src, len, packed, sizeof(packed));
+    }
+    double comp_sec = now_sec() - t0;
+
+    if (packed_len < 0) {
+        // Codec would be bypassed and the data sent raw
+        printf("%-8s %6d %-6s %7s %10.1f %10s  raw\n", input_name, len,
+               codec->name, "-", (double)len * iterations / comp_sec / 1e6, "-");
+        return;
+    }
+
+    t0 = now_sec();
+    for (int i = 0; i < iterations; i++) {
+        decompress_block(type, packed, packed_len, raw, sizeof(raw));
+    }
+    double decomp_sec = now_sec() - t0;
+    if (decompress_block(type, packed, packed_len, raw, sizeof(raw)) != len ||
+        memcmp(raw, src, len) != 0) {
+        printf("%s %d %s: round trip FAILED\n", input_name, len, codec->name);
+        exit(1);
+    }
+    printf("%-8s %6d %-6s %7.2f %10.1f %10.1f  %s\n", input_name, len, codec->name,
+           (double)len / packed_len, (double)len * iterations / comp_sec / 1e6,
+           (double)len * iterations / decomp_sec / 1e6, "compressed");
+}
+
+// Compress a WRITE's data, frame it with send_message, receive it with
+// recv_message on the other end of a socket pair and decompress it.
+// Reports wire bytes per request, loopback throughput (codec cost plus
+// framing) and throughput with the wire bytes on a 100 Mbit/s link.
+static void run_transfer(const char *input_name, const char *src, int len, const Codec *codec,
+                         int sv[2]) {
+    static char raw[MAX_DATA_SIZE];
+    int iterations = TARGET_BYTES / len;
+    long wire = 0;
+    Message out, in;
+    ClientRequest req;
+
+    double t0 = now_sec();
+    for (int i = 0; i < iterations; i++) {
+        memset(&req, 0, offsetof(ClientRequest, data));
+        int data_len = compress_block(codec->type, codec->level, src, len, req.data,
+                                      sizeof(req.data));
+        if (data_len > 0) {
+            req.compression = codec->type;
+        } else {
+            memcpy(req.data, src, len);
+            req.compression = COMP_NONE;
+            data_len = len;
+        }
+        req.data_len = data_len;
+        memset(&out, 0, MESSAGE_HEADER_SIZE);
+        out.type = MSG_CLIENT_REQUEST;
+        out.payload_len = offsetof(ClientRequest, data) + data_len;
+        memcpy(out.payload, &req, out.payload_len);
+        wire += MESSAGE_HEADER_SIZE + out.payload_len;
+        if (send_message(sv[0], &out) < 0 || recv_message(sv[1], &in) < 0) {
+            printf("%s %d %s: transfer FAILED\n", input_name, len, codec->name);
+            exit(1);
+        }
+        ClientRequest got;
+        memcpy(&got, in.payload, sizeof(got));
+        if (decompress_block(got.compression, got.data, got.data_len, raw, sizeof(raw)) != len ||
+            memcmp(raw, src, len) != 0) {
+            printf("%s %d %s: transfer round trip FAILED\n", input_name, len, codec->name);
+            exit(1);
+        }
+    }
+    double sec = now_sec() - t0;
+    double total = (double)len * iterations;
+    printf("%-8s %6d %-6s %8ld %12.1f %12.2f\n", input_name, len, codec->name,
+           wire / iterations, total / sec / 1e6,
+           total / (sec + wire / LINK_BYTES_PER_SEC) / 1e6);
+}
+
+int main(void) {
+    static char log_data[MAX_INPUT];
+    static char random_data[MAX_INPUT];
+    int sizes[] = {64, 256, 1024, 4096, 65536};
+    // zlib at the level used for transfers and at the one used for at-rest files
+    Codec codecs[] = {
+        {"lz4", COMP_LZ4, 0},
+        {"zlib1", COMP_ZLIB, COMP_LEVEL_TRANSFER},
+        {"zlib9", COMP_ZLIB, COMP_LEVEL_STORAGE},
+    };
+
+    srand(42);
+    fill_log(log_data, MAX_INPUT);
+    fill_random(random_data, MAX_INPUT);
+
+    printf("%-8s %6s %-6s %7s %10s %10s  %s\n", "input", "bytes", "codec", "ratio",
+           "comp MB/s", "dec MB/s", "result");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (size_t c = 0; c < sizeof(codecs) / sizeof(codecs[0]); c++) {
+            run("log", log_data, sizes[s], &codecs[c]);
+            run("random", random_data, sizes[s], &codecs[c]);
+        }
+    }
+
+    // WRITE data is at most MAX_DATA_SIZE bytes
+    int transfer_sizes[] = {64, 256, 1024};
+    Codec transfer_codecs[] = {
+        {"none", COMP_NONE, 0},
+        {"lz4", COMP_LZ4, 0},
+        {"zlib1", COMP_ZLIB, COMP_LEVEL_TRANSFER},
+    };
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+    printf("\n%-8s %6s %-6s %8s %12s %12s\n", "input", "bytes", "codec", "wire B",
+           "loopback MB/s", "100Mb/s MB/s");
+    for (size_t s = 0; s < sizeof(transfer_sizes) / sizeof(transfer_sizes[0]); s++) {
+        for (size_t c = 0; c < sizeof(transfer_codecs) / sizeof(transfer_codecs[0]); c++) {
+            run_transfer("log", log_data, transfer_sizes[s], &transfer_codecs[c], sv);
+            run_transfer("random", random_data, transfer_sizes[s], &transfer_codecs[c], sv);
+        }
+    }
+    close(sv[0]);
+    close(sv[1]);
+    return 0;
+}
@@ -0,0 +1,110 @@
+// read_bench.c
+// Sequential scan throughput of a file read through a storage server (one
+// READ, streamed back in READ_PIECE_SIZE pieces), cold and warm, next to a
+// raw cold disk read.
+// Start a storage server on <Base_Directory> first; the bench talks to it directly.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "../src/common/protocol.h"
+#include "../src/common/utils.h"
+
+#define BENCH_FILE "/readahead_bench.dat"
+#define RAW_BLOCK (1024 * 1024)
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Drop the file from the page cache so the next read comes from disk
+static void evict(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static int create_file(const char *path, long size) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) return -1;
+    char *block = malloc(RAW_BLOCK);
+    for (long done = 0; done < size; done += RAW_BLOCK) {
+        for (int i = 0; i < RAW_BLOCK; i++) block[i] = 'a' + (done / RAW_BLOCK + i) % 26;
+        fwrite(block, 1, size - done < RAW_BLOCK ? size - done : RAW_BLOCK, file);
+    }
+    free(block);
+    fclose(file);
+    return 0;
+}
+
+static double raw_scan(const char *path, long size) {
+    char *block = malloc(RAW_BLOCK);
+    int fd = open(path, O_RDONLY);
+    double t0 = now_sec();
+    while (read(fd, block, RAW_BLOCK) > 0) {
+    }
+    double sec = now_sec() - t0;
+    close(fd);
+    free(block);
+    return size / sec / 1e6;
+}
+
+static double ss_scan(const char *ss_ip, int ss_port, long size) {
+    double t0 = now_sec();
+    int sock = connect_to_server(ss_ip, ss_port);
+    if (sock < 0) {
+        exit(1);
+    }
+    Message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_SS_REQUEST;
+    SSRequest req;
+    memset(&req, 0, sizeof(req));
+    strcpy(req.command, "READ");
+    strcpy(req.path, BENCH_FILE);
+    memcpy(msg.payload, &req, sizeof(req));
+    msg.payload_len = offsetof(SSRequest, data);
+    send_message(sock, &msg);
+    long offset = 0;
+    do {
+        if (recv_message(sock, &msg) < 0 || msg.type != MSG_SS_RESPONSE) {
+            printf("READ failed at offset %ld\n", offset);
+            exit(1);
+        }
+        offset += msg.payload_len;
+    } while (msg.more);
+    close(sock);
+    if (offset != size) {
+        printf("READ returned %ld of %ld bytes\n", offset, size);
+        exit(1);
+    }
+    return size / (now_sec() - t0) / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 4) {
+        printf("Usage: %s <SS_IP> <SS_Port> <Base_Directory> [Size_MB]\n", argv[0]);
+        return -1;
+    }
+    long size = (argc > 4 ? atol(argv[4]) : 16) * 1024 * 1024;
+    char path[MAX_PATH_LENGTH * 2];
+    snprintf(path, sizeof(path), "%s%s", argv[3], BENCH_FILE);
+    if (create_file(path, size) < 0) {
+        perror("Failed to create bench file");
+        return -1;
+    }
+
+    evict(path);
+    printf("raw disk, cold:       %8.1f MB/s\n", raw_scan(path, size));
+    evict(path);
+    printf("storage server, cold: %8.1f MB/s\n", ss_scan(argv[1], atoi(argv[2]), size));
+    printf("storage server, warm: %8.1f MB/s\n", ss_scan(argv[1], atoi(argv[2]), size));
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Run shard_bench against 1, 2 and 4 naming server shards on localhost.
+# Usage: bench/run_shard_bench.sh [clients] [seconds] [files]   (from the repo root, after make all bench)
+# Each run starts with fresh shards, so every shard count sees the same files.
+CLIENTS=${1:-8}
+SECONDS_PER_RUN=${2:-5}
+FILES=${3:-900}
+BASE_PORT=9000
+
+for SHARDS in 1 2 4; do
+    ADDRS=""
+    for i in $(seq 0 $((SHARDS - 1))); do
+        ADDRS="$ADDRS 127.0.0.1:$((BASE_PORT + i))"
+    done
+    PIDS=""
+    for i in $(seq 0 $((SHARDS - 1))); do
+        ./naming_server $((BASE_PORT + i)) $i $ADDRS > /dev/null &
+        PIDS="$PIDS $!"
+    done
+    sleep 0.5
+    ./shard_bench 127.0.0.1 $BASE_PORT "$CLIENTS" "$SECONDS_PER_RUN" "$FILES"
+    kill $PIDS
+    wait $PIDS 2> /dev/null || true
+done
@@ -0,0 +1,165 @@
+// shard_bench.c
+// Metadata lookup throughput against one or more naming server shards.
+// The shards' tables are first filled with fake file entries (sent the way a
+// storage server heartbeat would), then each client process STATs random
+// entries from that set. Every lookup is a hit that scans the owning shard's
+// table under its lock, and no storage server round trip is involved.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include "../src/common/protocol.h"
+#include "../src/common/utils.h"
+
+#define DEFAULT_FILES 900 // Fits one shard's table (MAX_FILES in naming_server.c)
+
+ShardMap shard_map;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_path(char *out, size_t cap, int i) {
+    snprintf(out, cap, "/bench/file%d", i);
+}
+
+// Send one file list batch to every shard; each keeps the paths it owns.
+// Batches leave `complete` unset, so none replaces another's entries.
+static int send_batch(SSFileListUpdate *file_update) {
+    for (int s = 0; s < shard_map.shard_count; s++) {
+        int sock = connect_to_server(shard_map.shards[s].ip_address, shard_map.shards[s].port);
+        if (sock < 0) return -1;
+        Message msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.type = MSG_FILE_LIST_UPDATE;
+        memcpy(msg.payload, file_update, sizeof(SSFileListUpdate));
+        msg.payload_len = offsetof(SSFileListUpdate, file_paths) + strlen(file_update->file_paths);
+        send_message(sock, &msg);
+        close(sock);
+    }
+    return 0;
+}
+
+static int populate(int files) {
+    SSFileListUpdate file_update;
+    size_t used = 0;
+    memset(&file_update, 0, sizeof(file_update));
+    for (int i = 0; i < files; i++) {
+        char path[MAX_PATH_LENGTH];
+        char line[MAX_PATH_LENGTH + 64];
+        bench_path(path, sizeof(path), i);
+        int n = snprintf(line, sizeof(line), "%s\t%d\t%ld\t0\n", path, i, (long)time(NULL));
+        if (used + n >= sizeof(file_update.file_paths)) {
+            if (send_batch(&file_update) < 0) return -1;
+            memset(&file_update, 0, sizeof(file_update));
+            used = 0;
+        }
+        strcpy(file_update.ss_info.ip_address, "127.0.0.1");
+        file_update.ss_info.port = 20000;
+        memcpy(file_update.file_paths + used, line, n);
+        used += n;
+        file_update.file_count++;
+    }
+    return used > 0 ? send_batch(&file_update) : 0;
+}
+
+static int lookup(const char *path) {
+    NamingServerInfo *shard = &shard_map.shards[shard_for_path(path, shard_map.shard_count)];
+    int sock = connect_to_server(shard->ip_address, shard->port);
+    if (sock < 0) return -1;
+    Message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_CLIENT_REQUEST;
+    ClientRequest req;
+    memset(&req, 0, sizeof(req));
+    strcpy(req.command, "STAT");
+    strcpy(req.path, path);
+    memcpy(msg.payload, &req, sizeof(req));
+    msg.payload_len = offsetof(ClientRequest, data);
+    int rc = send_message(sock, &msg) == 0 ? recv_message(sock, &msg) : -1;
+    close(sock);
+    // Every path was populated, so anything but a STAT line is a failure
+    if (rc < 0 || msg.type != MSG_SS_RESPONSE) return -1;
+    return 0;
+}
+
+// Client process: look up random populated paths until the deadline, then
+// report "ops errors" on the pipe
+static void run_client(int id, int files, double deadline, int out_fd) {
+    long ops = 0, errors = 0;
+    char path[MAX_PATH_LENGTH];
+    srand(id + 1);
+    while (now_sec() < deadline) {
+        bench_path(path, sizeof(path), rand() % files);
+        if (lookup(path) == 0) {
+            ops++;
+        } else {
+            errors++;
+        }
+    }
+    char result[64];
+    int n = snprintf(result, sizeof(result), "%ld %ld\n", ops, errors);
+    write(out_fd, result, n);
+    close(out_fd);
+    _exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 5) {
+        printf("Usage: %s <NM_IP> <NM_Port> <Clients> <Seconds> [Files]\n", argv[0]);
+        return -1;
+    }
+    int clients = atoi(argv[3]);
+    int seconds = atoi(argv[4]);
+    int files = argc > 5 ? atoi(argv[5]) : DEFAULT_FILES;
+    if (clients <= 0 || seconds <= 0 || files <= 0) {
+        printf("Clients, Seconds and Files must be positive\n");
+        return -1;
+    }
+    if (fetch_shard_map(argv[1], atoi(argv[2]), &shard_map) < 0) {
+        printf("Failed to fetch shard map\n");
+        return -1;
+    }
+    if (populate(files) < 0) {
+        printf("Failed to populate naming server tables\n");
+        return -1;
+    }
+
+    // Separate processes, so client-side work doesn't share one address space
+    int pipes[2];
+    if (pipe(pipes) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    double deadline = now_sec() + seconds;
+    for (int i = 0; i < clients; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(pipes[0]);
+            run_client(i, files, deadline, pipes[1]);
+        } else if (pid < 0) {
+            perror("fork");
+            return -1;
+        }
+    }
+    close(pipes[1]);
+
+    long ops = 0, errors = 0;
+    FILE *results = fdopen(pipes[0], "r");
+    long client_ops, client_errors;
+    while (fscanf(results, "%ld %ld", &client_ops, &client_errors) == 2) {
+        ops += client_ops;
+        errors += client_errors;
+    }
+    fclose(results);
+    while (wait(NULL) > 0) {
+    }
+    printf("shards=%d clients=%d files=%d ops/s=%.0f errors=%ld\n", shard_map.shard_count,
+           clients, files, (double)ops / seconds, errors);
+    return 0;
+}
@@ -5,12 +5,21 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include "../common/protocol.h"
+#include "../common/compress.h"
+#include "../common/chunker.h"
+#include "../common/utils.h"
 
 #define MAX_INPUT_SIZE 1024
 
 #define UPPER(c) ((c >= 'a' && c <= 'z') ? c - 32 : c)
 
-int execute_command(const char *nm_ip, int nm_port, char *command, char *path, char *data) {
+CompressionType transfer_compression = COMP_NONE;
+
+// Fetched once at startup; requests go straight to the shard owning the path
+ShardMap shard_map;
+
+// Connect to a Naming Server and send one request. Returns the socket, or -1.
+int open_request(const char *nm_ip, int nm_port, ClientRequest *client_req) {
     // Connect to Naming Server
     int nm_sock = socket(AF_INET, SOCK_STREAM, 0);
     if (nm_sock < 0) {
@@ -34,48 +43,243 @@ int execute_command(const char *nm_ip, int nm_port, char *command, char *path, c
         return -1;
     }
 
-    // Send request to Naming Server
+    // Send request to Naming Server: only the used part of data goes out
     Message client_msg;
+    memset(&client_msg, 0, MESSAGE_HEADER_SIZE);
     client_msg.type = MSG_CLIENT_REQUEST;
-    ClientRequest client_req;
-    strcpy(client_req.command, command);
-    strcpy(client_req.path, path);
-    if (strcmp(command, "WRITE") == 0 && data != NULL) {
-        strcpy(client_req.data, data);
-    } else {
-        memset(client_req.data, 0, sizeof(client_req.data));
+    memcpy(client_msg.payload, client_req, sizeof(ClientRequest));
+    client_msg.payload_len = offsetof(ClientRequest, data) + client_req->data_len;
+    if (send_message(nm_sock, &client_msg) < 0) {
+        perror("Failed to send request");
+        close(nm_sock);
+        return -1;
+    }
+    return nm_sock;
+}
+
+// Send one request to the Naming Server and wait for its response
+int send_request(const char *nm_ip, int nm_port, ClientRequest *client_req, Message *response) {
+    int nm_sock = open_request(nm_ip, nm_port, client_req);
+    if (nm_sock < 0) {
+        return -1;
     }
-    memcpy(client_msg.payload, &client_req, sizeof(ClientRequest));
-    send(nm_sock, &client_msg, sizeof(client_msg), 0);
 
     // Receive response from Naming Server
-    Message nm_response;
-    int bytes_read = recv(nm_sock, &nm_response, sizeof(nm_response), 0);
-    if (bytes_read <= 0) {
+    int rc = recv_message(nm_sock, response);
+    close(nm_sock);
+    if (rc < 0) {
         printf("Failed to receive response from Naming Server\n");
-        close(nm_sock);
         return -1;
     }
+    return 0;
+}
+
+void init_request(ClientRequest *client_req, const char *command, const char *path) {
+    strcpy(client_req->command, command);
+    strcpy(client_req->path, path);
+    client_req->compression = COMP_NONE;
+    client_req->data_len = 0;
+    client_req->accept_compression = transfer_compression;
+    client_req->offset = 0;
+    memset(client_req->data, 0, sizeof(client_req->data));
+}
+
+// Write through a chunk store backend, sending only the chunks the storage
+// server doesn't have yet. Returns -1 (nothing written) if the server has no
+// chunk store, a plain WRITE would be as small on the wire, or a chunk was
+// swept after the probe; the caller then falls back.
+int write_chunked(const char *nm_ip, int nm_port, const char *path, const char *data,
+                  Message *response) {
+    // Chunk exactly what the server stores: the data plus a newline
+    char content[MAX_DATA_SIZE];
+    int len = strnlen(data, MAX_DATA_SIZE - 1);
+    memcpy(content, data, len);
+    content[len++] = '\n';
+
+    int ends[MAX_CHUNKS];
+    int count = chunk_boundaries(content, len, ends, MAX_CHUNKS);
+    if (count < 2) {
+        return -1;
+    }
+    // Even if every chunk is already stored, the probe round trip plus the
+    // manifest must cost fewer wire bytes than just sending the data
+    int probe_bytes = 2 * MESSAGE_HEADER_SIZE + offsetof(ClientRequest, data) +
+                      count * CHUNK_HASH_SIZE + count;
+    int manifest_bytes = sizeof(int) + count * sizeof(ChunkRef);
+    if (probe_bytes + manifest_bytes >= len) {
+        return -1;
+    }
+    ChunkRef refs[MAX_CHUNKS];
+    ClientRequest probe;
+    init_request(&probe, "CHUNKS", path);
+    probe.accept_compression = COMP_NONE;
+    int start = 0;
+    for (int i = 0; i < count; i++) {
+        refs[i].len = ends[i] - start;
+        chunk_hash(content + start, refs[i].len, refs[i].hash);
+        memcpy(probe.data + i * CHUNK_HASH_SIZE, refs[i].hash, CHUNK_HASH_SIZE);
+        start = ends[i];
+    }
+    probe.data_len = count * CHUNK_HASH_SIZE;
+
+    Message probe_response;
+    if (send_request(nm_ip, nm_port, &probe, &probe_response) < 0) {
+        return -1;
+    }
+    if (probe_response.type != MSG_SS_RESPONSE ||
+        strlen(probe_response.payload) != (size_t)count) {
+        return -1;
+    }
+
+    // Manifest, then the missing chunks
+    ClientRequest client_req;
+    init_request(&client_req, "WRITE_CHUNKS", path);
+    int offset = sizeof(int) + count * sizeof(ChunkRef);
+    start = 0;
+    for (int i = 0; i < count; i++) {
+        refs[i].included = probe_response.payload[i] == '0';
+        if (refs[i].included) {
+            if (offset + refs[i].len >= len) {
+                return -1;
+            }
+            memcpy(client_req.data + offset, content + start, refs[i].len);
+            offset += refs[i].len;
+        }
+        start = ends[i];
+    }
+    memcpy(client_req.data, &count, sizeof(int));
+    memcpy(client_req.data + sizeof(int), refs, count * sizeof(ChunkRef));
+    client_req.data_len = offset;
+    if (send_request(nm_ip, nm_port, &client_req, response) < 0 ||
+        (response->type == MSG_ERROR && strcmp(response->payload, ERR_MISSING_CHUNK) == 0)) {
+        return -1;
+    }
+    return 0;
+}
 
-    if (nm_response.type == MSG_SS_RESPONSE) {
+// Print a response. Returns the number of file bytes a READ response
+// carried, or -1 on error.
+int print_response(Message *nm_response) {
+    if (nm_response->type == MSG_SS_RESPONSE && nm_response->compression != COMP_NONE) {
+        // Compressed response payload
+        char raw[READ_PIECE_SIZE + 1];
+        int len = -1;
+        if (nm_response->payload_len > 0 && nm_response->payload_len <= MAX_PAYLOAD_SIZE) {
+            len = decompress_block(nm_response->compression, nm_response->payload,
+                                   nm_response->payload_len, raw, READ_PIECE_SIZE);
+        }
+        if (len < 0) {
+            printf("Error: Failed to decompress response\n");
+        } else {
+            raw[len] = '\0';
+            printf("%s", raw);
+        }
+        return len;
+    } else if (nm_response->type == MSG_SS_RESPONSE) {
         // Operation successful, print response
-        printf("%s", nm_response.payload);
-    } else if (nm_response.type == MSG_ERROR) {
-        printf("Error: %s\n", nm_response.payload);
+        printf("%s", nm_response->payload);
+        return nm_response->payload_len;
+    } else if (nm_response->type == MSG_ERROR) {
+        printf("Error: %s\n", nm_response->payload);
     }
+    return -1;
+}
 
+// Print a READ: a file longer than READ_PIECE_SIZE comes back as one response
+// per piece on the same connection, each but the last marked `more`.
+int read_file(const char *nm_ip, int nm_port, ClientRequest *client_req) {
+    int nm_sock = open_request(nm_ip, nm_port, client_req);
+    if (nm_sock < 0) {
+        return -1;
+    }
+    Message response;
+    do {
+        if (recv_message(nm_sock, &response) < 0) {
+            printf("Failed to receive response from Naming Server\n");
+            close(nm_sock);
+            return -1;
+        }
+    } while (print_response(&response) >= 0 && response.more);
     close(nm_sock);
     return 0;
 }
 
+int execute_command(char *command, char *path, char *data) {
+    NamingServerInfo *shard = &shard_map.shards[shard_for_path(path, shard_map.shard_count)];
+    const char *nm_ip = shard->ip_address;
+    int nm_port = shard->port;
+    Message nm_response;
+    if (strcmp(command, "WRITE") == 0 && data != NULL &&
+        write_chunked(nm_ip, nm_port, path, data, &nm_response) == 0) {
+        // Written as chunks
+        print_response(&nm_response);
+        return 0;
+    }
+
+    ClientRequest client_req;
+    init_request(&client_req, command, path);
+    if (strcmp(command, "LS") == 0) {
+        // Each shard lists the entries it owns
+        for (int i = 0; i < shard_map.shard_count; i++) {
+            if (send_request(shard_map.shards[i].ip_address, shard_map.shards[i].port,
+                             &client_req, &nm_response) == 0) {
+                print_response(&nm_response);
+            }
+        }
+        return 0;
+    }
+    if (strcmp(command, "RENAME") == 0 && data != NULL) {
+        // New path
+        snprintf(client_req.data, MAX_PATH_LENGTH, "%s", data);
+        client_req.data_len = strlen(client_req.data);
+    }
+    if (strcmp(command, "WRITE") == 0 && data != NULL) {
+        int len = -1;
+        if (transfer_compression != COMP_NONE) {
+            len = compress_block(transfer_compression, COMP_LEVEL_TRANSFER, data, strlen(data),
+                                 client_req.data, sizeof(client_req.data));
+        }
+        if (len > 0) {
+            client_req.compression = transfer_compression;
+            client_req.data_len = len;
+        } else {
+            strcpy(client_req.data, data);
+            client_req.data_len = strlen(data);
+        }
+    }
+
+    if (strcmp(command, "READ") == 0) {
+        return read_file(nm_ip, nm_port, &client_req);
+    }
+    if (send_request(nm_ip, nm_port, &client_req, &nm_response) < 0) {
+        return -1;
+    }
+    print_response(&nm_response);
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     if (argc < 3) {
-        printf("Usage: %s <NM_IP> <NM_Port>\n", argv[0]);
+        printf("Usage: %s <NM_IP> <NM_Port> [none|lz4|zlib]\n", argv[0]);
         return -1;
     }
 
     char *nm_ip = argv[1];
     int nm_port = atoi(argv[2]);
+    if (argc > 3) {
+        int comp = compression_from_name(argv[3]);
+        if (comp < 0) {
+            printf("Unknown compression: %s\n", argv[3]);
+            return -1;
+        }
+        transfer_compression = comp;
+    }
+    if (fetch_shard_map(nm_ip, nm_port, &shard_map) < 0 || shard_map.shard_count == 1) {
+        // Unsharded: everything goes to the given naming server
+        shard_map.shard_count = 1;
+        strcpy(shard_map.shards[0].ip_address, nm_ip);
+        shard_map.shards[0].port = nm_port;
+    }
 
     char input[MAX_INPUT_SIZE];
     char command[256], path[512], data[1024];
@@ -108,8 +312,10 @@ int main(int argc, char *argv[]) {
             break;
         }
 
-        if ((strcmp(command, "READ") != 0 && strcmp(command, "WRITE") != 0 && strcmp(command, "LIST") != 0) || 
-            (strcmp(command, "WRITE") == 0 && args < 3)) {
+        if ((strcmp(command, "READ") != 0 && strcmp(command, "WRITE") != 0 && strcmp(command, "LIST") != 0 &&
+             strcmp(command, "STAT") != 0 && strcmp(command, "LS") != 0 && strcmp(command, "DELETE") != 0 &&
+             strcmp(command, "RENAME") != 0 && strcmp(command, "MKDIR") != 0) ||
+            (strcmp(command, "WRITE") == 0 && args < 3) || (strcmp(command, "RENAME") == 0 && args < 3)) {
             printf("Invalid command or missing arguments.\n");
             continue;
         }
@@ -124,7 +330,8 @@ int main(int argc, char *argv[]) {
             data[strcspn(data, "\n")] = 0;
         }
 
-        execute_command(nm_ip, nm_port, command, path, (strcmp(command, "WRITE") == 0) ? data : NULL);
+        execute_command(command, path,
+                        (strcmp(command, "WRITE") == 0 || strcmp(command, "RENAME") == 0) ? data : NULL);
     }
 
     return 0;
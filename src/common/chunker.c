@@ -0,0 +1,51 @@
+// chunker.c
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <openssl/sha.h>
+
+#include "chunker.h"
+
+// Per-byte value of the gear rolling hash (splitmix64 finalizer)
+static uint64_t gear(unsigned char b) {
+    uint64_t z = b + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+int chunk_boundaries(const char *data, int len, int *ends, int max_chunks) {
+    int count = 0;
+    int start = 0;
+    while (start < len) {
+        int end = start + CHUNK_MAX_SIZE < len ? start + CHUNK_MAX_SIZE : len;
+        uint64_t h = 0;
+        for (int i = start + CHUNK_MIN_SIZE; i < end; i++) {
+            h = (h << 1) + gear((unsigned char)data[i]);
+            if ((h & CHUNK_BOUNDARY_MASK) == 0) {
+                end = i + 1;
+                break;
+            }
+        }
+        if (count == max_chunks) {
+            return -1;
+        }
+        ends[count++] = end;
+        start = end;
+    }
+    return count;
+}
+
+void chunk_hash(const char *data, int len, unsigned char hash[CHUNK_HASH_SIZE]) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char *)data, len, digest);
+    memcpy(hash, digest, CHUNK_HASH_SIZE);
+}
+
+void chunk_hash_hex(const unsigned char hash[CHUNK_HASH_SIZE], char *out) {
+    for (int i = 0; i < CHUNK_HASH_SIZE; i++) {
+        sprintf(out + 2 * i, "%02x", hash[i]);
+    }
+    out[2 * CHUNK_HASH_SIZE] = '\0';
+}
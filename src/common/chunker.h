@@ -0,0 +1,24 @@
+// chunker.h
+
+#ifndef CHUNKER_H
+#define CHUNKER_H
+
+#include "protocol.h"
+
+// Content-defined chunking: boundaries depend on the bytes around them, so an
+// edit only changes the chunks it touches
+#define CHUNK_MIN_SIZE 64
+#define CHUNK_MAX_SIZE 512
+#define CHUNK_BOUNDARY_MASK 0xff00000000000000ULL // ~256 byte average past the minimum
+
+// Split data into chunks. ends[i] receives the end offset of chunk i.
+// Returns the chunk count, or -1 if more than max_chunks would be needed.
+int chunk_boundaries(const char *data, int len, int *ends, int max_chunks);
+
+// Content hash of a chunk
+void chunk_hash(const char *data, int len, unsigned char hash[CHUNK_HASH_SIZE]);
+
+// Hex form of a chunk hash, used as its file name (out: 2 * CHUNK_HASH_SIZE + 1)
+void chunk_hash_hex(const unsigned char hash[CHUNK_HASH_SIZE], char *out);
+
+#endif // CHUNKER_H
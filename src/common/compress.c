@@ -0,0 +1,194 @@
+// compress.c
+
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "compress.h"
+
+// LZ4 block format (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md).
+// Small single-pass encoder so the fast codec needs no extra library.
+#define LZ4_MIN_MATCH 4
+#define LZ4_HASH_LOG 12
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_LAST_LITERALS 5  // last 5 bytes are always literals
+#define LZ4_MF_LIMIT 12      // last match must start 12 bytes before the end
+
+// Messages and stored files are a few KiB at most. A small window and hash
+// table keep deflate's per-call setup (~256 KiB with the defaults) from
+// dominating the cost without losing ratio at these sizes.
+#define ZLIB_WINDOW_BITS 12
+#define ZLIB_MEM_LEVEL 4
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz4_hash(uint32_t v) {
+    return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+// Write the 255-continuation bytes of a length whose first 4 bits are in the token
+static uint8_t *lz4_write_length(uint8_t *op, uint8_t *oend, int len) {
+    for (len -= 15; len >= 255; len -= 255) {
+        if (op >= oend) return NULL;
+        *op++ = 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static uint8_t *lz4_emit(uint8_t *op, uint8_t *oend, const uint8_t *lit, int lit_len,
+                         int offset, int match_len) {
+    if (op >= oend) return NULL;
+    uint8_t *token = op++;
+    *token = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+    if (lit_len >= 15 && (op = lz4_write_length(op, oend, lit_len)) == NULL) return NULL;
+    if (oend - op < lit_len) return NULL;
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (match_len == 0) return op; // last sequence: literals only
+
+    if (oend - op < 2) return NULL;
+    *op++ = (uint8_t)(offset & 0xff);
+    *op++ = (uint8_t)(offset >> 8);
+    int ml = match_len - LZ4_MIN_MATCH;
+    *token |= (uint8_t)(ml >= 15 ? 15 : ml);
+    if (ml >= 15 && (op = lz4_write_length(op, oend, ml)) == NULL) return NULL;
+    return op;
+}
+
+static int lz4_compress(const uint8_t *src, int src_len, uint8_t *dst, int dst_cap) {
+    int table[1 << LZ4_HASH_LOG];
+    uint8_t *op = dst, *oend = dst + dst_cap;
+    int ip = 0, anchor = 0;
+
+    for (int i = 0; i < (1 << LZ4_HASH_LOG); i++) table[i] = -1;
+
+    while (ip + LZ4_MF_LIMIT < src_len) {
+        uint32_t seq = read32(src + ip);
+        uint32_t h = lz4_hash(seq);
+        int ref = table[h];
+        table[h] = ip;
+        if (ref < 0 || ip - ref > LZ4_MAX_OFFSET || read32(src + ref) != seq) {
+            ip++;
+            continue;
+        }
+        int match_len = LZ4_MIN_MATCH;
+        while (ip + match_len < src_len - LZ4_LAST_LITERALS &&
+               src[ref + match_len] == src[ip + match_len]) {
+            match_len++;
+        }
+        op = lz4_emit(op, oend, src + anchor, ip - anchor, ip - ref, match_len);
+        if (op == NULL) return -1;
+        ip += match_len;
+        anchor = ip;
+    }
+    op = lz4_emit(op, oend, src + anchor, src_len - anchor, 0, 0);
+    if (op == NULL) return -1;
+    return (int)(op - dst);
+}
+
+static int lz4_decompress(const uint8_t *src, int src_len, uint8_t *dst, int dst_cap) {
+    int ip = 0, op = 0;
+    while (ip < src_len) {
+        uint8_t token = src[ip++];
+        int lit_len = token >> 4;
+        if (lit_len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= src_len) return -1;
+                b = src[ip++];
+                lit_len += b;
+            } while (b == 255);
+        }
+        if (lit_len > src_len - ip || lit_len > dst_cap - op) return -1;
+        memcpy(dst + op, src + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == src_len) break; // last sequence has no match
+
+        if (src_len - ip < 2) return -1;
+        int offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) return -1;
+        int match_len = token & 15;
+        if (match_len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= src_len) return -1;
+                b = src[ip++];
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += LZ4_MIN_MATCH;
+        if (match_len > dst_cap - op) return -1;
+        // Byte copy: match may overlap the bytes it produces
+        for (int i = 0; i < match_len; i++, op++) {
+            dst[op] = dst[op - offset];
+        }
+    }
+    return op;
+}
+
+int compress_block(CompressionType type, int level, const char *src, int src_len,
+                   char *dst, int dst_cap) {
+    int len = -1;
+    if (type == COMP_LZ4) {
+        len = lz4_compress((const uint8_t *)src, src_len, (uint8_t *)dst, dst_cap);
+    } else if (type == COMP_ZLIB) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, level, Z_DEFLATED, ZLIB_WINDOW_BITS, ZLIB_MEM_LEVEL,
+                         Z_DEFAULT_STRATEGY) == Z_OK) {
+            zs.next_in = (Bytef *)src;
+            zs.avail_in = src_len;
+            zs.next_out = (Bytef *)dst;
+            zs.avail_out = dst_cap;
+            if (deflate(&zs, Z_FINISH) == Z_STREAM_END) {
+                len = (int)zs.total_out;
+            }
+            deflateEnd(&zs);
+        }
+    }
+    // Not worth it: keep the raw bytes
+    if (len < 0 || len >= src_len) return -1;
+    return len;
+}
+
+int decompress_block(CompressionType type, const char *src, int src_len,
+                     char *dst, int dst_cap) {
+    if (type == COMP_NONE) {
+        if (src_len > dst_cap) return -1;
+        memcpy(dst, src, src_len);
+        return src_len;
+    } else if (type == COMP_LZ4) {
+        return lz4_decompress((const uint8_t *)src, src_len, (uint8_t *)dst, dst_cap);
+    } else if (type == COMP_ZLIB) {
+        uLongf out_len = dst_cap;
+        if (uncompress((Bytef *)dst, &out_len, (const Bytef *)src, src_len) != Z_OK) {
+            return -1;
+        }
+        return (int)out_len;
+    }
+    return -1;
+}
+
+const char *compression_name(CompressionType type) {
+    switch (type) {
+    case COMP_NONE: return "none";
+    case COMP_LZ4: return "lz4";
+    case COMP_ZLIB: return "zlib";
+    }
+    return "unknown";
+}
+
+int compression_from_name(const char *name) {
+    if (strcmp(name, "none") == 0) return COMP_NONE;
+    if (strcmp(name, "lz4") == 0) return COMP_LZ4;
+    if (strcmp(name, "zlib") == 0) return COMP_ZLIB;
+    return -1;
+}
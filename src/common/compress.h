@@ -0,0 +1,29 @@
+// compress.h
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "protocol.h"
+
+// zlib effort (LZ4 has a single level). Transfers are compressed on every
+// request and response, so they favour speed; at-rest files are written
+// once and read many times, so they favour ratio.
+#define COMP_LEVEL_TRANSFER 1
+#define COMP_LEVEL_STORAGE 9
+
+// Compress src into dst using the given codec and level.
+// Returns the compressed length, or -1 if the output did not fit in dst_cap
+// or would not be smaller than the input (caller should send it raw instead).
+int compress_block(CompressionType type, int level, const char *src, int src_len,
+                   char *dst, int dst_cap);
+
+// Decompress src into dst. Returns the decompressed length, or -1 on
+// corrupt input or if the result does not fit in dst_cap.
+int decompress_block(CompressionType type, const char *src, int src_len,
+                     char *dst, int dst_cap);
+
+// Codec name <-> CompressionType ("none", "lz4", "zlib")
+const char *compression_name(CompressionType type);
+int compression_from_name(const char *name); // -1 if unknown
+
+#endif // COMPRESS_H
@@ -6,7 +6,8 @@
 #define MAX_PATH_LENGTH 256
 #define MAX_COMMAND_LENGTH 16
 #define MAX_DATA_SIZE 1024
-#define MAX_PAYLOAD_SIZE 2048
+#define READ_PIECE_SIZE (64 * 1024) // File bytes per streamed READ response
+#define MAX_PAYLOAD_SIZE (READ_PIECE_SIZE + MAX_DATA_SIZE)
 
 typedef enum {
     MSG_REGISTER_SS,
@@ -16,32 +17,84 @@ typedef enum {
     MSG_SS_REQUEST,
     MSG_SS_RESPONSE,
     MSG_ERROR,
-    MSG_FILE_LIST_UPDATE // New message type
+    MSG_FILE_LIST_UPDATE, // New message type
+    MSG_SHARD_MAP_REQUEST,
+    MSG_SHARD_MAP,
+    MSG_PREFIX_UPDATE
 } MessageType;
 
+// Codec applied to request data / response payload bytes
+typedef enum {
+    COMP_NONE,
+    COMP_LZ4,  // fast
+    COMP_ZLIB  // better ratio
+} CompressionType;
+
+// Size and modification time of a file, as seen by its storage server
+typedef struct {
+    long size;  // Content bytes (uncompressed, reassembled)
+    long mtime;
+    int is_dir;
+} FileStat;
+
 typedef struct {
     MessageType type;
+    int compression;  // CompressionType of payload (responses only)
+    int payload_len;  // Bytes used in payload; only these are sent
+    int more;         // READ: another response follows on this connection
+    FileStat stat;    // WRITE/RENAME/MKDIR responses: the file's new metadata
     char payload[MAX_PAYLOAD_SIZE];
 } Message;
 
+#define SS_FEATURE_CHUNK_STORE 0x1 // Accepts CHUNKS / WRITE_CHUNKS
+
 // Unified Storage Server info
 typedef struct {
     char ip_address[16];
     int port;
+    int features; // SS_FEATURE_* bits, advertised at registration
 } StorageServerInfo;
 
 // Alias SSRegisterInfo to StorageServerInfo
 typedef StorageServerInfo SSRegisterInfo;
 
-// Storage Server file list update
+// Naming server shards use the same address layout
+typedef StorageServerInfo NamingServerInfo;
+
+#define MAX_SHARDS 16
+
+// Paths are partitioned across naming server shards by hash (see shard_for_path)
 typedef struct {
+    int shard_count;
+    NamingServerInfo shards[MAX_SHARDS];
+} ShardMap;
+
+// Storage Server file list update, sent at registration and as a heartbeat.
+// One "path\tsize\tmtime\tis_dir\n" line per file. A long list spans several
+// frames on one connection, each but the last with Message.more set.
+typedef struct {
+    StorageServerInfo ss_info;
     int file_count;
-    char file_paths[MAX_DATA_SIZE]; // A concatenated string of file paths
+    int complete; // Last frame: the list named every file the server holds
+    char file_paths[MAX_PAYLOAD_SIZE - sizeof(StorageServerInfo) - 2 * sizeof(int)];
 } SSFileListUpdate;
 
+// Sent between naming server shards after a directory RENAME or DELETE,
+// since the directory's children can hash to any shard: each shard moves
+// its entries under old_prefix to new_prefix, or drops them if new_prefix
+// is empty.
+typedef struct {
+    char old_prefix[MAX_PATH_LENGTH];
+    char new_prefix[MAX_PATH_LENGTH];
+} PrefixUpdate;
+
 typedef struct {
     char command[MAX_COMMAND_LENGTH];
     char path[MAX_PATH_LENGTH];
+    int compression;        // CompressionType of data
+    int data_len;           // Bytes used in data when compression != COMP_NONE
+    int accept_compression; // Codec the client can decode in the response
+    long offset;            // READ: first byte to return; the rest of the file follows
     char data[MAX_DATA_SIZE];
 } ClientRequest;
 
@@ -49,7 +102,28 @@ typedef struct {
 typedef struct {
     char command[MAX_COMMAND_LENGTH];
     char path[MAX_PATH_LENGTH];
+    int compression;
+    int data_len;
+    int accept_compression;
+    long offset;
     char data[MAX_DATA_SIZE];
 } SSRequest;
 
+// Chunked writes ("CHUNKS" probe, "WRITE_CHUNKS") for the chunk store backend.
+// The naming server answers a probe itself, with one of these errors, when
+// there is no storage server to take the path or it has no chunk store.
+#define ERR_NEW_FILE "New file"
+#define ERR_NO_CHUNK_STORE "No chunk store"
+#define ERR_MISSING_CHUNK "Missing chunk\n" // Swept since the probe: send a plain WRITE
+#define CHUNK_HASH_SIZE 16 // Truncated SHA-256
+#define MAX_CHUNKS 16 // MAX_DATA_SIZE / CHUNK_MIN_SIZE
+
+// WRITE_CHUNKS data: int chunk_count, ChunkRef[chunk_count], then the bytes
+// of every chunk with included set, in manifest order
+typedef struct {
+    unsigned char hash[CHUNK_HASH_SIZE];
+    unsigned short len;
+    unsigned char included; // 0 if the server already has the chunk
+} ChunkRef;
+
 #endif // PROTOCOL_H
\ No newline at end of file
@@ -0,0 +1,109 @@
+// utils.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "utils.h"
+
+int shard_for_path(const char *path, int shard_count) {
+    // FNV-1a
+    unsigned int h = 2166136261U;
+    for (const char *p = path; *p; p++) {
+        h ^= (unsigned char)*p;
+        h *= 16777619U;
+    }
+    return shard_count > 1 ? (int)(h % shard_count) : 0;
+}
+
+int connect_to_server(const char *ip, int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("Socket creation error");
+        return -1;
+    }
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &addr.sin_addr) <= 0) {
+        perror("Invalid server IP");
+        close(sock);
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Connection failed");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int send_message(int sock, const Message *msg) {
+    if (msg->payload_len < 0 || msg->payload_len > MAX_PAYLOAD_SIZE) {
+        return -1;
+    }
+    const char *buf = (const char *)msg;
+    size_t len = MESSAGE_HEADER_SIZE + msg->payload_len;
+    while (len > 0) {
+        // MSG_NOSIGNAL: a peer that went away is an error, not SIGPIPE
+        ssize_t sent = send(sock, buf, len, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return -1;
+        }
+        buf += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+int send_text_message(int sock, Message *msg) {
+    msg->payload_len = strnlen(msg->payload, MAX_PAYLOAD_SIZE);
+    return send_message(sock, msg);
+}
+
+int recv_message(int sock, Message *msg) {
+    if (recv(sock, msg, MESSAGE_HEADER_SIZE, MSG_WAITALL) != (ssize_t)MESSAGE_HEADER_SIZE ||
+        msg->payload_len < 0 || msg->payload_len > MAX_PAYLOAD_SIZE) {
+        return -1;
+    }
+    if (msg->payload_len > 0 &&
+        recv(sock, msg->payload, msg->payload_len, MSG_WAITALL) != msg->payload_len) {
+        return -1;
+    }
+    memset(msg->payload + msg->payload_len, 0, MAX_PAYLOAD_SIZE - msg->payload_len);
+    return 0;
+}
+
+int fetch_shard_map(const char *nm_ip, int nm_port, ShardMap *map) {
+    int nm_sock = connect_to_server(nm_ip, nm_port);
+    if (nm_sock < 0) {
+        return -1;
+    }
+
+    Message msg;
+    memset(&msg, 0, MESSAGE_HEADER_SIZE);
+    msg.type = MSG_SHARD_MAP_REQUEST;
+    int rc = send_message(nm_sock, &msg) == 0 ? recv_message(nm_sock, &msg) : -1;
+    close(nm_sock);
+    if (rc < 0 || msg.type != MSG_SHARD_MAP) {
+        return -1;
+    }
+    memcpy(map, msg.payload, sizeof(ShardMap));
+    if (map->shard_count < 1 || map->shard_count > MAX_SHARDS) {
+        return -1;
+    }
+    return 0;
+}
+
+int parse_address(const char *text, NamingServerInfo *info) {
+    const char *colon = strchr(text, ':');
+    if (colon == NULL || colon - text >= (int)sizeof(info->ip_address)) {
+        return -1;
+    }
+    memcpy(info->ip_address, text, colon - text);
+    info->ip_address[colon - text] = '\0';
+    info->port = atoi(colon + 1);
+    return info->port > 0 ? 0 : -1;
+}
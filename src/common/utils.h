@@ -0,0 +1,38 @@
+// utils.h
+
+#ifndef UTILS_H
+#define UTILS_H
+
+#include <stddef.h>
+#include "protocol.h"
+
+// Index of the naming server shard that owns path
+int shard_for_path(const char *path, int shard_count);
+
+// Open a TCP connection to ip:port. Returns the socket, or -1 on failure.
+int connect_to_server(const char *ip, int port);
+
+// Messages go on the wire as the header (every field before payload)
+// followed by only the first payload_len payload bytes, so short or
+// compressed payloads cost only the bytes they use.
+#define MESSAGE_HEADER_SIZE offsetof(Message, payload)
+
+// Send msg as a header plus msg->payload_len payload bytes.
+// Returns 0 on success, -1 if the connection failed.
+int send_message(int sock, const Message *msg);
+
+// send_message with payload_len set to the length of the text in payload
+int send_text_message(int sock, Message *msg);
+
+// Receive one message sent with send_message. Payload bytes past
+// payload_len are zeroed, so text and truncated structs read back whole.
+// Returns 0 on success, -1 on a closed connection or malformed frame.
+int recv_message(int sock, Message *msg);
+
+// Ask a naming server for the shard map. Returns 0 on success, -1 on failure.
+int fetch_shard_map(const char *nm_ip, int nm_port, ShardMap *map);
+
+// Parse "IP:Port" into info. Returns 0 on success, -1 if malformed.
+int parse_address(const char *text, NamingServerInfo *info);
+
+#endif // UTILS_H
@@ -4,15 +4,21 @@
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include "../common/protocol.h"
+#include "../common/utils.h"
 #define PORT 9000
 #define MAX_SS 100
 #define MAX_FILES 1000
+#define LIST_GRACE 2 // Seconds a new entry survives a complete file list that may predate it
 
 typedef struct {
     char path[MAX_PATH_LENGTH];
     StorageServerInfo ss_info;
+    FileStat stat; // Reported by the storage server; answers STAT and LS
+    time_t recorded; // When this shard last added or updated the entry
+    unsigned long list_seq; // Last storage server file list that named it
 } FileInfo;
 
 StorageServerInfo storage_servers[MAX_SS];
@@ -20,38 +26,333 @@ int ss_count = 0;
 
 FileInfo file_info_list[MAX_FILES];
 int file_count = 0;
+unsigned long last_list_seq = 0; // Numbers each file list received, under file_mutex
+int reserved_files = 0; // Slots held for new files a storage server is creating
 
 pthread_mutex_t ss_mutex;
 pthread_mutex_t file_mutex;
 
-void add_file_info(const char *path, StorageServerInfo ss_info) {
-    pthread_mutex_lock(&file_mutex);
+// This server owns the paths that hash to shard_index
+ShardMap shard_map;
+int shard_index = 0;
+
+int owns_path(const char *path) {
+    return shard_for_path(path, shard_map.shard_count) == shard_index;
+}
+
+// Add or update an entry with file_mutex held. list_seq is the file list
+// naming it, or 0 when the entry comes from a client operation.
+// Returns 0 on success, -1 if a new entry doesn't fit.
+static int store_file_info(const char *path, StorageServerInfo ss_info, FileStat stat,
+                           unsigned long list_seq) {
+    FileInfo *entry = NULL;
     // Check if file already exists
     for (int i = 0; i < file_count; i++) {
         if (strcmp(file_info_list[i].path, path) == 0) {
-            // Update storage server info
-            file_info_list[i].ss_info = ss_info;
-            pthread_mutex_unlock(&file_mutex);
-            return;
+            entry = &file_info_list[i];
+            break;
+        }
+    }
+    if (entry == NULL) {
+        if (file_count + reserved_files >= MAX_FILES) {
+            return -1;
+        }
+        // Add new file info
+        entry = &file_info_list[file_count++];
+        strcpy(entry->path, path);
+        entry->list_seq = 0;
+    }
+    entry->ss_info = ss_info;
+    entry->stat = stat;
+    entry->recorded = time(NULL);
+    if (list_seq != 0) {
+        entry->list_seq = list_seq;
+    }
+    return 0;
+}
+
+int record_file_info(const char *path, StorageServerInfo ss_info, FileStat stat,
+                     unsigned long list_seq) {
+    pthread_mutex_lock(&file_mutex);
+    int rc = store_file_info(path, ss_info, stat, list_seq);
+    pthread_mutex_unlock(&file_mutex);
+    return rc;
+}
+
+int add_file_info(const char *path, StorageServerInfo ss_info, FileStat stat) {
+    return record_file_info(path, ss_info, stat, 0);
+}
+
+// Hold a slot for a file about to be created, so the entry is sure to fit
+// once the storage server has made it. Returns -1 if the table is full.
+int reserve_file_slot(void) {
+    pthread_mutex_lock(&file_mutex);
+    int rc = -1;
+    if (file_count + reserved_files < MAX_FILES) {
+        reserved_files++;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&file_mutex);
+    return rc;
+}
+
+// Give back a reserved slot, filling it with the new file's entry unless
+// stat is NULL (the storage server didn't create it)
+void release_file_slot(const char *path, StorageServerInfo ss_info, const FileStat *stat) {
+    pthread_mutex_lock(&file_mutex);
+    reserved_files--;
+    if (stat != NULL) {
+        store_file_info(path, ss_info, *stat, 0);
+    }
+    pthread_mutex_unlock(&file_mutex);
+}
+
+// Move an entry to new_path in place: a rename never needs a new slot.
+// Returns -1 if the entry is gone and a new one doesn't fit.
+int rename_file_info(const char *path, const char *new_path, StorageServerInfo ss_info,
+                     FileStat stat) {
+    pthread_mutex_lock(&file_mutex);
+    for (int i = 0; i < file_count; i++) {
+        if (strcmp(file_info_list[i].path, new_path) == 0) {
+            // Replaced an existing file
+            file_info_list[i] = file_info_list[--file_count];
+            break;
+        }
+    }
+    for (int i = 0; i < file_count; i++) {
+        if (strcmp(file_info_list[i].path, path) == 0) {
+            strcpy(file_info_list[i].path, new_path);
+            break;
+        }
+    }
+    int rc = store_file_info(new_path, ss_info, stat, 0);
+    pthread_mutex_unlock(&file_mutex);
+    return rc;
+}
+
+void remove_file_info(const char *path) {
+    pthread_mutex_lock(&file_mutex);
+    for (int i = 0; i < file_count; i++) {
+        if (strcmp(file_info_list[i].path, path) == 0) {
+            file_info_list[i] = file_info_list[--file_count];
+            break;
         }
     }
-    // Add new file info
-    strcpy(file_info_list[file_count].path, path);
-    file_info_list[file_count].ss_info = ss_info;
-    file_count++;
     pthread_mutex_unlock(&file_mutex);
 }
 
-StorageServerInfo* find_storage_server(const char *path) {
+// Copy out the entry for path. Returns 0 if found, -1 otherwise.
+int find_file_info(const char *path, FileInfo *out) {
     pthread_mutex_lock(&file_mutex);
     for (int i = 0; i < file_count; i++) {
         if (strcmp(file_info_list[i].path, path) == 0) {
+            *out = file_info_list[i];
             pthread_mutex_unlock(&file_mutex);
-            return &file_info_list[i].ss_info;
+            return 0;
         }
     }
     pthread_mutex_unlock(&file_mutex);
-    return NULL;
+    return -1;
+}
+
+// One `ls -l`-style line
+int format_file_info(char *out, size_t cap, const char *path, FileStat stat) {
+    char when[32];
+    time_t mtime = stat.mtime;
+    struct tm tm; // Not localtime(): its static buffer is shared by every thread
+    localtime_r(&mtime, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M", &tm);
+    return snprintf(out, cap, "%c %10ld %s %s\n",
+                    stat.is_dir ? 'd' : '-', stat.size, when, path);
+}
+
+// Entries directly under dir, one line each, from this shard's table
+void list_directory(const char *dir, char *out, size_t cap) {
+    size_t dir_len = strlen(dir);
+    if (dir_len > 0 && dir[dir_len - 1] == '/') {
+        dir_len--; // "/" and "/a/" list the children of "" and "/a"
+    }
+    size_t used = 0;
+    out[0] = '\0';
+    pthread_mutex_lock(&file_mutex);
+    for (int i = 0; i < file_count; i++) {
+        const char *path = file_info_list[i].path;
+        if (strncmp(path, dir, dir_len) != 0 || path[dir_len] != '/' ||
+            path[dir_len + 1] == '\0' || strchr(path + dir_len + 1, '/') != NULL) {
+            continue;
+        }
+        int n = format_file_info(out + used, cap - used, path, file_info_list[i].stat);
+        if (n < 0 || used + n >= cap) {
+            out[used] = '\0';
+            break; // Out of room
+        }
+        used += n;
+    }
+    pthread_mutex_unlock(&file_mutex);
+}
+
+// Record the files in one frame of a storage server's file list that
+// this shard owns, tagged with the list's sequence number. Returns how
+// many didn't fit in the table.
+int apply_file_list_update(SSFileListUpdate *file_update, unsigned long list_seq) {
+    int dropped = 0;
+    char *saveptr;
+    file_update->file_paths[sizeof(file_update->file_paths) - 1] = '\0';
+    char *token = strtok_r(file_update->file_paths, "\n", &saveptr);
+    while (token != NULL) {
+        char path[MAX_PATH_LENGTH];
+        FileStat stat;
+        if (sscanf(token, "%255[^\t]\t%ld\t%ld\t%d",
+                   path, &stat.size, &stat.mtime, &stat.is_dir) == 4 && owns_path(path)) {
+            if (record_file_info(path, file_update->ss_info, stat, list_seq) < 0) {
+                dropped++;
+            }
+        }
+        token = strtok_r(NULL, "\n", &saveptr);
+    }
+    return dropped;
+}
+
+// After a complete file list: drop the server's entries the list didn't
+// name (deleted or renamed outside the protocol, or by a missed update),
+// except ones recorded too recently for the list to include
+void prune_unlisted(StorageServerInfo ss_info, unsigned long list_seq, time_t received) {
+    pthread_mutex_lock(&file_mutex);
+    for (int i = 0; i < file_count; i++) {
+        FileInfo *entry = &file_info_list[i];
+        if (entry->list_seq != list_seq && entry->ss_info.port == ss_info.port &&
+            strcmp(entry->ss_info.ip_address, ss_info.ip_address) == 0 &&
+            entry->recorded <= received - LIST_GRACE) {
+            file_info_list[i--] = file_info_list[--file_count];
+        }
+    }
+    pthread_mutex_unlock(&file_mutex);
+}
+
+// Apply a storage server's file list, starting from the frame in msg and
+// reading the rest of the sequence from sock. Pruning waits for the last frame.
+void receive_file_list(int sock, Message *msg) {
+    time_t received = time(NULL);
+    pthread_mutex_lock(&file_mutex);
+    unsigned long list_seq = ++last_list_seq;
+    pthread_mutex_unlock(&file_mutex);
+
+    SSFileListUpdate *file_update = malloc(sizeof(SSFileListUpdate));
+    if (file_update == NULL) {
+        return;
+    }
+    int dropped = 0;
+    while (1) {
+        memcpy(file_update, msg->payload, sizeof(SSFileListUpdate));
+        dropped += apply_file_list_update(file_update, list_seq);
+        if (!msg->more) {
+            if (file_update->complete) {
+                prune_unlisted(file_update->ss_info, list_seq, received);
+            }
+            break;
+        }
+        if (recv_message(sock, msg) < 0 || msg->type != MSG_FILE_LIST_UPDATE) {
+            break; // Cut short: keep what arrived, prune nothing
+        }
+    }
+    if (dropped > 0) {
+        printf("File table full: %d files from Storage Server %s:%d not tracked\n",
+               dropped, file_update->ss_info.ip_address, file_update->ss_info.port);
+    }
+    free(file_update);
+}
+
+// Tell the shard owning path about a file that moved there (cross-shard RENAME)
+void notify_owner_shard(const char *path, StorageServerInfo ss_info, FileStat stat) {
+    NamingServerInfo *owner = &shard_map.shards[shard_for_path(path, shard_map.shard_count)];
+    int nm_sock = connect_to_server(owner->ip_address, owner->port);
+    if (nm_sock < 0) {
+        return; // The storage server's next heartbeat will catch it up
+    }
+    Message msg;
+    memset(&msg, 0, MESSAGE_HEADER_SIZE);
+    msg.type = MSG_FILE_LIST_UPDATE;
+    SSFileListUpdate file_update;
+    memset(&file_update, 0, sizeof(file_update));
+    file_update.ss_info = ss_info;
+    file_update.file_count = 1;
+    snprintf(file_update.file_paths, sizeof(file_update.file_paths), "%s\t%ld\t%ld\t%d\n",
+             path, stat.size, stat.mtime, stat.is_dir);
+    memcpy(msg.payload, &file_update, sizeof(SSFileListUpdate));
+    msg.payload_len = offsetof(SSFileListUpdate, file_paths) + strlen(file_update.file_paths);
+    send_message(nm_sock, &msg);
+    close(nm_sock);
+}
+
+// Move this shard's entries under dir/ to new_dir/, or drop them if new_dir
+// is NULL. Moved entries that now hash to another shard are handed to it.
+void move_children(const char *dir, const char *new_dir) {
+    size_t dir_len = strlen(dir);
+    FileInfo *moved = malloc(sizeof(FileInfo) * MAX_FILES);
+    int moved_count = 0;
+    if (moved == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&file_mutex);
+    for (int i = 0; i < file_count; i++) {
+        const char *path = file_info_list[i].path;
+        if (strncmp(path, dir, dir_len) != 0 || path[dir_len] != '/') {
+            continue;
+        }
+        if (new_dir != NULL) {
+            moved[moved_count] = file_info_list[i];
+            int n = snprintf(moved[moved_count].path, MAX_PATH_LENGTH, "%s%s",
+                             new_dir, path + dir_len);
+            if (n < MAX_PATH_LENGTH && owns_path(moved[moved_count].path)) {
+                // Stays on this shard: rename in place, keeping its slot
+                file_info_list[i].recorded = time(NULL);
+                strcpy(file_info_list[i].path, moved[moved_count].path);
+                continue;
+            }
+            if (n < MAX_PATH_LENGTH) {
+                moved_count++;
+            }
+        }
+        file_info_list[i--] = file_info_list[--file_count];
+    }
+    pthread_mutex_unlock(&file_mutex);
+
+    for (int i = 0; i < moved_count; i++) {
+        notify_owner_shard(moved[i].path, moved[i].ss_info, moved[i].stat);
+    }
+    free(moved);
+}
+
+// Have every other shard move (or drop) its entries under dir/
+void broadcast_prefix_update(const char *dir, const char *new_dir) {
+    Message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_PREFIX_UPDATE;
+    PrefixUpdate update;
+    memset(&update, 0, sizeof(update));
+    snprintf(update.old_prefix, sizeof(update.old_prefix), "%s", dir);
+    if (new_dir != NULL) {
+        snprintf(update.new_prefix, sizeof(update.new_prefix), "%s", new_dir);
+    }
+    memcpy(msg.payload, &update, sizeof(PrefixUpdate));
+    msg.payload_len = sizeof(PrefixUpdate);
+    for (int i = 0; i < shard_map.shard_count; i++) {
+        if (i == shard_index) {
+            continue;
+        }
+        int nm_sock = connect_to_server(shard_map.shards[i].ip_address, shard_map.shards[i].port);
+        if (nm_sock < 0) {
+            continue; // The storage server's next heartbeat will catch it up
+        }
+        send_message(nm_sock, &msg);
+        close(nm_sock);
+    }
+}
+
+// Directory RENAME/DELETE: update the children on every shard
+void update_children(const char *dir, const char *new_dir) {
+    move_children(dir, new_dir);
+    broadcast_prefix_update(dir, new_dir);
 }
 
 void *handle_connection(void *arg)
@@ -59,8 +360,7 @@ void *handle_connection(void *arg)
 	int client_sock = *(int *)arg;
 	free(arg);
 	Message msg;
-	int bytes_read = recv(client_sock, &msg, sizeof(msg), 0);
-	if (bytes_read <= 0)
+	if (recv_message(client_sock, &msg) < 0)
 	{
 		close(client_sock);
 		pthread_exit(NULL);
@@ -71,32 +371,48 @@ void *handle_connection(void *arg)
 		SSRegisterInfo ss_info;
 		memcpy(&ss_info, msg.payload, sizeof(SSRegisterInfo));
 		pthread_mutex_lock(&ss_mutex);
-		strcpy(storage_servers[ss_count].ip_address, ss_info.ip_address);
-		storage_servers[ss_count].port = ss_info.port;
+		storage_servers[ss_count] = ss_info;
 		ss_count++;
 		pthread_mutex_unlock(&ss_mutex);
 		printf("Registered Storage Server: %s:%d\n",
 			   ss_info.ip_address, ss_info.port);
 		// Send acknowledgment
 		Message ack;
+		memset(&ack, 0, MESSAGE_HEADER_SIZE);
 		ack.type = MSG_REGISTER_ACK;
-		send(client_sock, &ack, sizeof(ack), 0);
+		send_message(client_sock, &ack);
 
         // Receive file list update
-        bytes_read = recv(client_sock, &msg, sizeof(msg), 0);
-        if (bytes_read > 0 && msg.type == MSG_FILE_LIST_UPDATE) {
-            SSFileListUpdate file_update;
-            memcpy(&file_update, msg.payload, sizeof(SSFileListUpdate));
-
-            char *token = strtok(file_update.file_paths, "\n");
-            while (token != NULL) {
-                add_file_info(token, ss_info);
-                token = strtok(NULL, "\n");
-            }
+        if (recv_message(client_sock, &msg) == 0 && msg.type == MSG_FILE_LIST_UPDATE) {
+            receive_file_list(client_sock, &msg);
             printf("Updated file list from Storage Server %s:%d\n",
                    ss_info.ip_address, ss_info.port);
         }
 	}
+	else if (msg.type == MSG_FILE_LIST_UPDATE)
+	{
+		// Heartbeat from a storage server, or a file renamed into this shard
+		receive_file_list(client_sock, &msg);
+	}
+	else if (msg.type == MSG_PREFIX_UPDATE)
+	{
+		// Another shard renamed or deleted a directory
+		PrefixUpdate update;
+		memcpy(&update, msg.payload, sizeof(PrefixUpdate));
+		update.old_prefix[MAX_PATH_LENGTH - 1] = '\0';
+		update.new_prefix[MAX_PATH_LENGTH - 1] = '\0';
+		move_children(update.old_prefix,
+					  update.new_prefix[0] != '\0' ? update.new_prefix : NULL);
+	}
+	else if (msg.type == MSG_SHARD_MAP_REQUEST)
+	{
+		Message map_msg;
+		memset(&map_msg, 0, MESSAGE_HEADER_SIZE);
+		map_msg.type = MSG_SHARD_MAP;
+		memcpy(map_msg.payload, &shard_map, sizeof(ShardMap));
+		map_msg.payload_len = sizeof(ShardMap);
+		send_message(client_sock, &map_msg);
+	}
 	else if (msg.type == MSG_CLIENT_REQUEST)
 	{
 		// Handle client requests
@@ -106,8 +422,16 @@ void *handle_connection(void *arg)
 			   client_req.command, client_req.path);
 
 		Message nm_response;
+		memset(&nm_response, 0, MESSAGE_HEADER_SIZE);
+		nm_response.compression = COMP_NONE;
 
-        if (strcmp(client_req.command, "LIST") == 0) {
+        if (strcmp(client_req.command, "LIST") != 0 && strcmp(client_req.command, "LS") != 0 &&
+            !owns_path(client_req.path)) {
+            // Client routed with a stale or missing shard map
+            nm_response.type = MSG_ERROR;
+            strcpy(nm_response.payload, "Path belongs to another naming server shard");
+            send_text_message(client_sock, &nm_response);
+        } else if (strcmp(client_req.command, "LIST") == 0) {
             // Aggregate list from all storage servers
             char aggregated_list[MAX_DATA_SIZE * MAX_SS] = {0};
             pthread_mutex_lock(&ss_mutex);
@@ -135,17 +459,23 @@ void *handle_connection(void *arg)
 
                 // Send LIST request to Storage Server
                 Message ss_msg;
+                memset(&ss_msg, 0, MESSAGE_HEADER_SIZE);
                 ss_msg.type = MSG_SS_REQUEST;
                 SSRequest ss_req;
                 strcpy(ss_req.command, "LIST");
                 strcpy(ss_req.path, client_req.path);
-                memcpy(ss_msg.payload, &ss_req, sizeof(SSRequest));
-                send(ss_sock, &ss_msg, sizeof(ss_msg), 0);
+                ss_req.compression = COMP_NONE;
+                ss_req.data_len = 0;
+                ss_req.accept_compression = COMP_NONE;
+                ss_req.offset = 0;
+                memcpy(ss_msg.payload, &ss_req, offsetof(SSRequest, data));
+                ss_msg.payload_len = offsetof(SSRequest, data);
+                send_message(ss_sock, &ss_msg);
 
                 // Receive response from Storage Server
                 Message ss_response;
-                bytes_read = recv(ss_sock, &ss_response, sizeof(ss_response), 0);
-                if (bytes_read > 0 && ss_response.type == MSG_SS_RESPONSE) {
+                if (recv_message(ss_sock, &ss_response) == 0 &&
+                    ss_response.type == MSG_SS_RESPONSE) {
                     strcat(aggregated_list, ss_response.payload);
                 }
                 close(ss_sock);
@@ -153,30 +483,97 @@ void *handle_connection(void *arg)
             pthread_mutex_unlock(&ss_mutex);
             nm_response.type = MSG_SS_RESPONSE;
             strcpy(nm_response.payload, aggregated_list);
-            send(client_sock, &nm_response, sizeof(nm_response), 0);
+            send_text_message(client_sock, &nm_response);
+        } else if (strcmp(client_req.command, "STAT") == 0) {
+            // Answered from memory: no storage server involved
+            FileInfo info;
+            if (find_file_info(client_req.path, &info) < 0) {
+                nm_response.type = MSG_ERROR;
+                strcpy(nm_response.payload, "File not found");
+            } else {
+                nm_response.type = MSG_SS_RESPONSE;
+                format_file_info(nm_response.payload, MAX_PAYLOAD_SIZE, info.path, info.stat);
+                nm_response.payload_len = strlen(nm_response.payload);
+            }
+            send_text_message(client_sock, &nm_response);
+        } else if (strcmp(client_req.command, "LS") == 0) {
+            // This shard's part of the listing; the client merges all shards
+            nm_response.type = MSG_SS_RESPONSE;
+            list_directory(client_req.path, nm_response.payload, MAX_PAYLOAD_SIZE);
+            nm_response.payload_len = strlen(nm_response.payload);
+            send_text_message(client_sock, &nm_response);
         } else if (strcmp(client_req.command, "READ") == 0 ||
-                   strcmp(client_req.command, "WRITE") == 0) {
+                   strcmp(client_req.command, "WRITE") == 0 ||
+                   strcmp(client_req.command, "WRITE_CHUNKS") == 0 ||
+                   strcmp(client_req.command, "CHUNKS") == 0 ||
+                   strcmp(client_req.command, "DELETE") == 0 ||
+                   strcmp(client_req.command, "RENAME") == 0 ||
+                   strcmp(client_req.command, "MKDIR") == 0) {
+            int is_write = strcmp(client_req.command, "WRITE") == 0 ||
+                           strcmp(client_req.command, "WRITE_CHUNKS") == 0 ||
+                           strcmp(client_req.command, "MKDIR") == 0;
+            if (strcmp(client_req.command, "RENAME") == 0 &&
+                (client_req.data[0] != '/' ||
+                 strnlen(client_req.data, MAX_PATH_LENGTH) == MAX_PATH_LENGTH)) {
+                nm_response.type = MSG_ERROR;
+                strcpy(nm_response.payload, "Invalid new path");
+                send_text_message(client_sock, &nm_response);
+                close(client_sock);
+                pthread_exit(NULL);
+            }
+            if (client_req.data_len < 0 || client_req.data_len > MAX_DATA_SIZE) {
+                nm_response.type = MSG_ERROR;
+                strcpy(nm_response.payload, "Invalid request");
+                send_text_message(client_sock, &nm_response);
+                close(client_sock);
+                pthread_exit(NULL);
+            }
             // Locate the storage server
-            StorageServerInfo *ss_info = find_storage_server(client_req.path);
-            if (ss_info == NULL && strcmp(client_req.command, "WRITE") == 0) {
+            FileInfo info;
+            StorageServerInfo *ss_info = NULL;
+            if (find_file_info(client_req.path, &info) == 0) {
+                ss_info = &info.ss_info;
+            }
+            if (strcmp(client_req.command, "CHUNKS") == 0 && ss_info == NULL) {
+                // New path: probe the storage server a WRITE would pick, so
+                // a copy of a stored file still deduplicates
+                pthread_mutex_lock(&ss_mutex);
+                if (ss_count > 0) {
+                    info.ss_info = storage_servers[0];
+                    ss_info = &info.ss_info;
+                }
+                pthread_mutex_unlock(&ss_mutex);
+            }
+            if (strcmp(client_req.command, "CHUNKS") == 0 &&
+                (ss_info == NULL || !(ss_info->features & SS_FEATURE_CHUNK_STORE))) {
+                // Nothing to deduplicate against: answer without a storage server round trip
+                nm_response.type = MSG_ERROR;
+                strcpy(nm_response.payload, ss_info == NULL ? ERR_NEW_FILE : ERR_NO_CHUNK_STORE);
+                send_text_message(client_sock, &nm_response);
+                close(client_sock);
+                pthread_exit(NULL);
+            }
+            int new_file = 0;
+            if (ss_info == NULL && is_write) {
                 // For WRITE command, if file doesn't exist, assign it to a storage server
                 pthread_mutex_lock(&ss_mutex);
                 if (ss_count > 0) {
-                    ss_info = &storage_servers[0]; // Simple strategy: pick the first server
-                    add_file_info(client_req.path, *ss_info);
+                    info.ss_info = storage_servers[0]; // Simple strategy: pick the first server
+                    ss_info = &info.ss_info;
+                    new_file = 1;
                     pthread_mutex_unlock(&ss_mutex);
                 } else {
                     pthread_mutex_unlock(&ss_mutex);
                     nm_response.type = MSG_ERROR;
                     strcpy(nm_response.payload, "No storage servers available");
-                    send(client_sock, &nm_response, sizeof(nm_response), 0);
+                    send_text_message(client_sock, &nm_response);
                     close(client_sock);
                     pthread_exit(NULL);
                 }
             } else if (ss_info == NULL) {
                 nm_response.type = MSG_ERROR;
                 strcpy(nm_response.payload, "File not found");
-                send(client_sock, &nm_response, sizeof(nm_response), 0);
+                send_text_message(client_sock, &nm_response);
                 close(client_sock);
                 pthread_exit(NULL);
             }
@@ -187,7 +584,7 @@ void *handle_connection(void *arg)
                 perror("Socket creation error");
                 nm_response.type = MSG_ERROR;
                 strcpy(nm_response.payload, "Internal server error");
-                send(client_sock, &nm_response, sizeof(nm_response), 0);
+                send_text_message(client_sock, &nm_response);
                 close(client_sock);
                 pthread_exit(NULL);
             }
@@ -199,7 +596,7 @@ void *handle_connection(void *arg)
                 close(ss_sock);
                 nm_response.type = MSG_ERROR;
                 strcpy(nm_response.payload, "Internal server error");
-                send(client_sock, &nm_response, sizeof(nm_response), 0);
+                send_text_message(client_sock, &nm_response);
                 close(client_sock);
                 pthread_exit(NULL);
             }
@@ -208,40 +605,92 @@ void *handle_connection(void *arg)
                 close(ss_sock);
                 nm_response.type = MSG_ERROR;
                 strcpy(nm_response.payload, "Storage server unavailable");
-                send(client_sock, &nm_response, sizeof(nm_response), 0);
+                send_text_message(client_sock, &nm_response);
+                close(client_sock);
+                pthread_exit(NULL);
+            }
+            if (new_file && reserve_file_slot() < 0) {
+                // Refuse before the storage server creates a file we couldn't track
+                close(ss_sock);
+                nm_response.type = MSG_ERROR;
+                strcpy(nm_response.payload, "Too many files");
+                send_text_message(client_sock, &nm_response);
                 close(client_sock);
                 pthread_exit(NULL);
             }
 
             // Send request to Storage Server
             Message ss_msg;
+            memset(&ss_msg, 0, MESSAGE_HEADER_SIZE);
             ss_msg.type = MSG_SS_REQUEST;
             SSRequest ss_req;
             strcpy(ss_req.command, client_req.command);
             strcpy(ss_req.path, client_req.path);
-            strcpy(ss_req.data, client_req.data);
+            ss_req.compression = client_req.compression;
+            ss_req.data_len = client_req.data_len;
+            ss_req.accept_compression = client_req.accept_compression;
+            ss_req.offset = client_req.offset;
+            memcpy(ss_req.data, client_req.data, MAX_DATA_SIZE); // may be binary
             memcpy(ss_msg.payload, &ss_req, sizeof(SSRequest));
-            send(ss_sock, &ss_msg, sizeof(ss_msg), 0);
+            ss_msg.payload_len = offsetof(SSRequest, data) + ss_req.data_len;
+            send_message(ss_sock, &ss_msg);
 
             // Receive response from Storage Server
             Message ss_response;
-            bytes_read = recv(ss_sock, &ss_response, sizeof(ss_response), 0);
-            if (bytes_read > 0) {
-                // Update file mapping if it's a write command
-                if (strcmp(client_req.command, "WRITE") == 0) {
-                    add_file_info(client_req.path, *ss_info);
+            int received = recv_message(ss_sock, &ss_response);
+            if (new_file) {
+                release_file_slot(client_req.path, *ss_info,
+                                  received == 0 && ss_response.type == MSG_SS_RESPONSE ?
+                                  &ss_response.stat : NULL);
+            }
+            if (received == 0) {
+                // Keep the file mapping and metadata in step with the storage server
+                int tracked = 0;
+                if (ss_response.type == MSG_SS_RESPONSE && is_write && !new_file) {
+                    tracked = add_file_info(client_req.path, *ss_info, ss_response.stat);
+                } else if (ss_response.type == MSG_SS_RESPONSE &&
+                           strcmp(client_req.command, "DELETE") == 0) {
+                    remove_file_info(client_req.path);
+                    if (info.stat.is_dir) {
+                        update_children(client_req.path, NULL);
+                    }
+                } else if (ss_response.type == MSG_SS_RESPONSE &&
+                           strcmp(client_req.command, "RENAME") == 0) {
+                    if (owns_path(client_req.data)) {
+                        tracked = rename_file_info(client_req.path, client_req.data,
+                                                   *ss_info, ss_response.stat);
+                    } else {
+                        remove_file_info(client_req.path);
+                        notify_owner_shard(client_req.data, *ss_info, ss_response.stat);
+                    }
+                    if (ss_response.stat.is_dir) {
+                        update_children(client_req.path, client_req.data);
+                    }
+                }
+                if (tracked < 0) {
+                    // The entry vanished meanwhile and the table filled up
+                    memset(&ss_response, 0, MESSAGE_HEADER_SIZE);
+                    ss_response.type = MSG_ERROR;
+                    strcpy(ss_response.payload, "Too many files");
+                    ss_response.payload_len = strlen(ss_response.payload);
+                }
+                // A long READ streams its remaining pieces: pass them through
+                // until the last one, or until the client goes away
+                int relayed = send_message(client_sock, &ss_response);
+                while (relayed == 0 && ss_response.more &&
+                       recv_message(ss_sock, &ss_response) == 0) {
+                    relayed = send_message(client_sock, &ss_response);
                 }
-                send(client_sock, &ss_response, sizeof(ss_response), 0);
             } else {
                 nm_response.type = MSG_ERROR;
                 strcpy(nm_response.payload, "Failed to receive response from storage server");
-                send(client_sock, &nm_response, sizeof(nm_response), 0);
+                send_text_message(client_sock, &nm_response);
             }
             close(ss_sock);
         } else {
             nm_response.type = MSG_ERROR;
             strcpy(nm_response.payload, "Unknown command");
-            send(client_sock, &nm_response, sizeof(nm_response), 0);
+            send_text_message(client_sock, &nm_response);
         }
 	}
 	else
@@ -253,24 +702,55 @@ void *handle_connection(void *arg)
 	pthread_exit(NULL);
 }
 
-int main()
+int main(int argc, char *argv[])
 {
 	int server_fd, *new_sock;
 	struct sockaddr_in address;
 	int addrlen = sizeof(address);
+	int port = PORT;
 	pthread_mutex_init(&ss_mutex, NULL);
     pthread_mutex_init(&file_mutex, NULL);
 
+	if (argc > 1)
+	{
+		port = atoi(argv[1]);
+	}
+	// Unsharded by default: this server owns every path
+	shard_map.shard_count = 1;
+	strcpy(shard_map.shards[0].ip_address, "127.0.0.1");
+	shard_map.shards[0].port = port;
+	if (argc > 2)
+	{
+		shard_index = atoi(argv[2]);
+		shard_map.shard_count = argc - 3;
+		if (shard_map.shard_count < 1 || shard_map.shard_count > MAX_SHARDS ||
+			shard_index < 0 || shard_index >= shard_map.shard_count)
+		{
+			printf("Usage: %s [<Port> [<Shard_Index> <NM_IP:Port>...]]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		for (int i = 0; i < shard_map.shard_count; i++)
+		{
+			if (parse_address(argv[3 + i], &shard_map.shards[i]) < 0)
+			{
+				printf("Invalid shard address: %s\n", argv[3 + i]);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
 	// Create socket
 	if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0)
 	{
 		perror("Socket failed");
 		exit(EXIT_FAILURE);
 	}
+	int opt = 1;
+	setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 	// Bind socket to port
 	address.sin_family = AF_INET;
 	address.sin_addr.s_addr = INADDR_ANY; // Listen on all interfaces
-	address.sin_port = htons(PORT);
+	address.sin_port = htons(port);
 
 	if (bind(server_fd, (struct sockaddr *)&address,
 			 sizeof(address)) < 0)
@@ -284,7 +764,8 @@ int main()
 		perror("Listen failed");
 		exit(EXIT_FAILURE);
 	}
-	printf("Naming Server listening on port %d...\n", PORT);
+	printf("Naming Server (shard %d of %d) listening on port %d...\n",
+		   shard_index, shard_map.shard_count, port);
 	while (1)
 	{
 		new_sock = malloc(sizeof(int));
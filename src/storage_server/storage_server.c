@@ -9,62 +9,601 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <errno.h>
 
 #include "../common/protocol.h"
-
-#define NM_PORT 9000
+#include "../common/compress.h"
+#include "../common/chunker.h"
+#include "../common/utils.h"
+
+#define NM_PORT 9000 // Naming server port when <NM_IP> doesn't give one
+#define STORED_MAGIC "\x89NFZ"
+#define MANIFEST_MAGIC "\x89NFM"
+#define CHUNK_DIR ".chunks"
+#define HEARTBEAT_INTERVAL 10 // Seconds between file list updates (and chunk sweeps)
+
+typedef enum {
+    BACKEND_FLAT,   // One file per path (default)
+    BACKEND_CHUNKED // Deduplicated chunks under CHUNK_DIR + per-path manifests
+} StorageBackend;
+
+// Header of a file kept compressed under base_dir.
+// Files without it are plain and read back as they are.
+typedef struct {
+    char magic[4];
+    int compression;
+    int raw_len;
+} StoredFileHeader;
 
 char base_dir[MAX_PATH_LENGTH];
+CompressionType store_compression = COMP_NONE;
+StorageBackend storage_backend = BACKEND_FLAT;
+
+// Naming servers to register with and send heartbeats to
+ShardMap shard_map;
+SSRegisterInfo local_info;
+
+// Chunked backend: requests hold chunk_lock shared while they use manifests
+// and chunks, the sweep holds it exclusively. chunks_dirty is set when a
+// request may have dropped a manifest's last reference to a chunk; it
+// starts set so chunks orphaned before this run are swept too.
+pthread_rwlock_t chunk_lock = PTHREAD_RWLOCK_INITIALIZER;
+int chunks_dirty = 1;
+
+// Manifest kept at a path's location by the chunked backend,
+// followed by chunk_count ChunkRefs
+typedef struct {
+    char magic[4];
+    int chunk_count;
+} ManifestHeader;
+
+// Read a file as stored on disk. For compressed files buf receives the
+// compressed bytes and hdr describes them; plain files get COMP_NONE and
+// are read from offset. Returns the number of bytes in buf, or -1 if the
+// file can't be opened.
+int read_stored_file(const char *full_path, char *buf, int cap, StoredFileHeader *hdr,
+                     long offset) {
+    FILE *file = fopen(full_path, "rb");
+    if (file == NULL) {
+        return -1;
+    }
+    int len;
+    if (fread(hdr, 1, sizeof(*hdr), file) == sizeof(*hdr) &&
+        memcmp(hdr->magic, STORED_MAGIC, sizeof(hdr->magic)) == 0) {
+        len = fread(buf, 1, cap, file);
+    } else {
+        fseek(file, offset, SEEK_SET);
+        hdr->compression = COMP_NONE;
+        len = fread(buf, 1, cap < MAX_DATA_SIZE ? cap : MAX_DATA_SIZE, file);
+        hdr->raw_len = len;
+    }
+    fclose(file);
+    return len;
+}
+
+// Write raw file content, compressed with store_compression when that
+// makes it smaller. Returns 0 on success, -1 on failure.
+int write_stored_file(const char *full_path, const char *raw, int raw_len) {
+    char packed[MAX_PAYLOAD_SIZE];
+    int packed_len = -1;
+    if (store_compression != COMP_NONE) {
+        packed_len = compress_block(store_compression, COMP_LEVEL_STORAGE, raw, raw_len, packed, sizeof(packed));
+    }
+    FILE *file = fopen(full_path, "wb");
+    if (file == NULL) {
+        return -1;
+    }
+    if (packed_len > 0) {
+        StoredFileHeader hdr;
+        memcpy(hdr.magic, STORED_MAGIC, sizeof(hdr.magic));
+        hdr.compression = store_compression;
+        hdr.raw_len = raw_len;
+        fwrite(&hdr, 1, sizeof(hdr), file);
+        fwrite(packed, 1, packed_len, file);
+    } else {
+        fwrite(raw, 1, raw_len, file);
+    }
+    fclose(file);
+    return 0;
+}
+
+void chunk_file_path(char *out, size_t cap, const unsigned char *hash) {
+    char hex[2 * CHUNK_HASH_SIZE + 1];
+    chunk_hash_hex(hash, hex);
+    snprintf(out, cap, "%s/%s/%s", base_dir, CHUNK_DIR, hex);
+}
 
-void send_file_list(const char *nm_ip, int nm_port, SSRegisterInfo ss_info) {
-    // Collect file list
-    DIR *dir = opendir(base_dir);
+int have_chunk(const unsigned char *hash) {
+    char path[MAX_PATH_LENGTH * 2];
+    chunk_file_path(path, sizeof(path), hash);
+    return access(path, F_OK) == 0;
+}
+
+// Store a chunk unless it is already present. Written to a temporary
+// name first so concurrent readers never see a partial chunk.
+int store_chunk(const unsigned char *hash, const char *data, int len) {
+    if (have_chunk(hash)) {
+        return 0;
+    }
+    char path[MAX_PATH_LENGTH * 2];
+    char tmp_path[MAX_PATH_LENGTH * 2 + 32];
+    chunk_file_path(path, sizeof(path), hash);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%lx", path, (unsigned long)pthread_self());
+    if (write_stored_file(tmp_path, data, len) < 0) {
+        return -1;
+    }
+    return rename(tmp_path, path);
+}
+
+// Read a chunk into buf. Returns its length, or -1 if missing or corrupt.
+int load_chunk(const unsigned char *hash, char *buf, int cap) {
+    char path[MAX_PATH_LENGTH * 2];
+    char stored[MAX_PAYLOAD_SIZE];
+    StoredFileHeader hdr;
+    chunk_file_path(path, sizeof(path), hash);
+    int len = read_stored_file(path, stored, sizeof(stored), &hdr, 0);
+    if (len < 0) {
+        return -1;
+    }
+    return decompress_block(hdr.compression, stored, len, buf, cap);
+}
+
+int write_manifest(const char *full_path, const ChunkRef *refs, int count) {
+    FILE *file = fopen(full_path, "wb");
+    if (file == NULL) {
+        return -1;
+    }
+    ManifestHeader hdr;
+    memcpy(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic));
+    hdr.chunk_count = count;
+    fwrite(&hdr, 1, sizeof(hdr), file);
+    for (int i = 0; i < count; i++) {
+        ChunkRef ref = refs[i];
+        ref.included = 0;
+        fwrite(&ref, 1, sizeof(ref), file);
+    }
+    fclose(file);
+    return 0;
+}
+
+// Returns the chunk count, or -1 if the file is missing or not a manifest
+int read_manifest(const char *full_path, ChunkRef *refs, int max) {
+    FILE *file = fopen(full_path, "rb");
+    if (file == NULL) {
+        return -1;
+    }
+    ManifestHeader hdr;
+    int count = -1;
+    if (fread(&hdr, 1, sizeof(hdr), file) == sizeof(hdr) &&
+        memcmp(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic)) == 0 &&
+        hdr.chunk_count >= 0 && hdr.chunk_count <= max &&
+        fread(refs, sizeof(ChunkRef), hdr.chunk_count, file) == (size_t)hdr.chunk_count) {
+        count = hdr.chunk_count;
+    }
+    fclose(file);
+    return count;
+}
+
+// Chunked backend: store raw content as chunks plus a manifest
+int write_chunked_file(const char *full_path, const char *raw, int raw_len) {
+    int ends[MAX_CHUNKS];
+    ChunkRef refs[MAX_CHUNKS];
+    int count = chunk_boundaries(raw, raw_len, ends, MAX_CHUNKS);
+    if (count < 0) {
+        return -1;
+    }
+    int start = 0;
+    for (int i = 0; i < count; i++) {
+        refs[i].len = ends[i] - start;
+        chunk_hash(raw + start, refs[i].len, refs[i].hash);
+        if (store_chunk(refs[i].hash, raw + start, refs[i].len) < 0) {
+            return -1;
+        }
+        start = ends[i];
+    }
+    return write_manifest(full_path, refs, count);
+}
+
+// Chunked backend: reassemble a file from its manifest.
+// Returns the length, -1 if the path holds no manifest, -2 if a chunk is bad.
+int read_chunked_file(const char *full_path, char *raw, int cap) {
+    ChunkRef refs[MAX_CHUNKS];
+    int count = read_manifest(full_path, refs, MAX_CHUNKS);
+    if (count < 0) {
+        return -1;
+    }
+    int len = 0;
+    for (int i = 0; i < count; i++) {
+        if (load_chunk(refs[i].hash, raw + len, cap - len) != refs[i].len) {
+            return -2;
+        }
+        len += refs[i].len;
+    }
+    return len;
+}
+
+// Apply a WRITE_CHUNKS request: store the included chunks, check the
+// others are already present, then write the manifest
+const char *write_chunks_request(const char *full_path, const SSRequest *req) {
+    int count;
+    if (req->data_len < (int)sizeof(int) || req->data_len > MAX_DATA_SIZE) {
+        return "Invalid write data\n";
+    }
+    memcpy(&count, req->data, sizeof(int));
+    if (count <= 0 || count > MAX_CHUNKS) {
+        return "Invalid write data\n";
+    }
+    int offset = sizeof(int) + count * sizeof(ChunkRef);
+    if (offset > req->data_len) {
+        return "Invalid write data\n";
+    }
+    ChunkRef refs[MAX_CHUNKS];
+    memcpy(refs, req->data + sizeof(int), count * sizeof(ChunkRef));
+
+    int total = 0;
+    for (int i = 0; i < count; i++) {
+        total += refs[i].len;
+        if (refs[i].len == 0 || total > MAX_DATA_SIZE) {
+            return "Invalid write data\n";
+        }
+        if (!refs[i].included) {
+            if (!have_chunk(refs[i].hash)) {
+                return ERR_MISSING_CHUNK;
+            }
+            continue;
+        }
+        if (offset + refs[i].len > req->data_len) {
+            return "Invalid write data\n";
+        }
+        unsigned char hash[CHUNK_HASH_SIZE];
+        chunk_hash(req->data + offset, refs[i].len, hash);
+        if (memcmp(hash, refs[i].hash, CHUNK_HASH_SIZE) != 0) {
+            return "Chunk hash mismatch\n";
+        }
+        if (store_chunk(hash, req->data + offset, refs[i].len) < 0) {
+            return "Failed to store chunk\n";
+        }
+        offset += refs[i].len;
+    }
+    if (write_manifest(full_path, refs, count) < 0) {
+        return "Failed to open file for writing\n";
+    }
+    return NULL;
+}
+
+// Hex names of the chunks live manifests refer to
+typedef struct {
+    char (*names)[2 * CHUNK_HASH_SIZE + 1];
+    int count;
+    int cap;
+} ChunkNameSet;
+
+int compare_chunk_names(const void *a, const void *b) {
+    return strcmp(a, b);
+}
+
+// Add the chunks of every manifest under rel_dir ("" for base_dir itself)
+// to live. Returns -1 if a directory couldn't be read or memory ran out:
+// the set is then incomplete and nothing may be swept.
+int mark_live_chunks(const char *rel_dir, ChunkNameSet *live) {
+    char dirpath[MAX_PATH_LENGTH * 2];
+    snprintf(dirpath, sizeof(dirpath), "%s%s", base_dir, rel_dir);
+    DIR *dir = opendir(dirpath);
     if (dir == NULL) {
-        perror("Failed to open base directory");
-        return;
+        return -1;
     }
+    int rc = 0;
     struct dirent *dp;
-    char file_paths[MAX_DATA_SIZE] = {0};
-    char filepath[MAX_PATH_LENGTH * 2];
-    struct stat statbuf;
-    while ((dp = readdir(dir)) != NULL) {
-        snprintf(filepath, sizeof(filepath), "%s/%s", base_dir, dp->d_name);
-        if (stat(filepath, &statbuf) == 0) {
-            if (S_ISREG(statbuf.st_mode)) { // Check if it's a regular file
-                strcat(file_paths, "/");
-                strcat(file_paths, dp->d_name);
-                strcat(file_paths, "\n");
+    char rel_path[MAX_PATH_LENGTH * 2];
+    char filepath[MAX_PATH_LENGTH * 3];
+    ChunkRef refs[MAX_CHUNKS];
+    while (rc == 0 && (dp = readdir(dir)) != NULL) {
+        if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0 ||
+            strcmp(dp->d_name, CHUNK_DIR) == 0) {
+            continue;
+        }
+        snprintf(rel_path, sizeof(rel_path), "%s/%s", rel_dir, dp->d_name);
+        snprintf(filepath, sizeof(filepath), "%s%s", base_dir, rel_path);
+        struct stat statbuf;
+        if (lstat(filepath, &statbuf) < 0) {
+            continue;
+        }
+        if (S_ISDIR(statbuf.st_mode)) {
+            rc = mark_live_chunks(rel_path, live);
+            continue;
+        }
+        int count = read_manifest(filepath, refs, MAX_CHUNKS);
+        if (count > 0 && live->count + count > live->cap) {
+            int cap = live->cap * 2 + count + 64;
+            void *names = realloc(live->names, cap * sizeof(*live->names));
+            if (names == NULL) {
+                rc = -1;
+                break;
             }
+            live->names = names;
+            live->cap = cap;
+        }
+        for (int i = 0; i < count; i++) {
+            chunk_hash_hex(refs[i].hash, live->names[live->count++]);
         }
     }
     closedir(dir);
+    return rc;
+}
 
-    // Send file list to naming server
-    int nm_sock;
-    struct sockaddr_in nm_addr;
-    if ((nm_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("Socket creation error");
+// Delete the chunks no manifest refers to any more, along with temporary
+// files a crashed write left behind. Runs only after a request may have
+// orphaned some, with every request that uses chunks held off.
+void sweep_chunks(void) {
+    pthread_rwlock_wrlock(&chunk_lock);
+    if (!chunks_dirty) {
+        pthread_rwlock_unlock(&chunk_lock);
         return;
     }
-    nm_addr.sin_family = AF_INET;
-    nm_addr.sin_port = htons(nm_port);
-    if (inet_pton(AF_INET, nm_ip, &nm_addr.sin_addr) <= 0) {
-        perror("Invalid Naming Server IP");
+    int removed = 0;
+    ChunkNameSet live = {NULL, 0, 0};
+    char chunk_dir[MAX_PATH_LENGTH * 2];
+    snprintf(chunk_dir, sizeof(chunk_dir), "%s/%s", base_dir, CHUNK_DIR);
+    DIR *dir;
+    if (mark_live_chunks("", &live) == 0 && (dir = opendir(chunk_dir)) != NULL) {
+        qsort(live.names, live.count, sizeof(*live.names), compare_chunk_names);
+        struct dirent *dp;
+        char path[MAX_PATH_LENGTH * 3];
+        while ((dp = readdir(dir)) != NULL) {
+            if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0 ||
+                (live.count > 0 && bsearch(dp->d_name, live.names, live.count,
+                                           sizeof(*live.names), compare_chunk_names))) {
+                continue;
+            }
+            snprintf(path, sizeof(path), "%s/%s", chunk_dir, dp->d_name);
+            if (unlink(path) == 0) {
+                removed++;
+            }
+        }
+        closedir(dir);
+        chunks_dirty = 0;
+    }
+    free(live.names);
+    pthread_rwlock_unlock(&chunk_lock);
+    if (removed > 0) {
+        printf("Swept %d unreferenced chunks\n", removed);
+    }
+}
+
+// Drop the bytes before offset from whole-file content read into raw.
+// Returns the remaining length.
+int slice_from(char *raw, int raw_len, long offset) {
+    if (offset >= raw_len) {
+        return 0;
+    }
+    memmove(raw, raw + offset, raw_len - offset);
+    return raw_len - offset;
+}
+
+// Put raw data in the response payload, compressed if the client
+// accepts a codec and it pays off
+void fill_response_payload(Message *response, const char *raw, int raw_len, int accept) {
+    int len = -1;
+    if (accept != COMP_NONE) {
+        len = compress_block(accept, COMP_LEVEL_TRANSFER, raw, raw_len, response->payload, MAX_PAYLOAD_SIZE);
+    }
+    if (len > 0) {
+        response->compression = accept;
+        response->payload_len = len;
+    } else {
+        memcpy(response->payload, raw, raw_len);
+        response->payload[raw_len] = '\0';
+        response->compression = COMP_NONE;
+        response->payload_len = raw_len;
+    }
+}
+
+// Delete a file, or a directory with everything under it.
+// Returns 0 on success, -1 on failure.
+int delete_path(const char *full_path) {
+    struct stat statbuf;
+    if (lstat(full_path, &statbuf) < 0) {
+        return -1;
+    }
+    if (!S_ISDIR(statbuf.st_mode)) {
+        return unlink(full_path);
+    }
+    DIR *dir = opendir(full_path);
+    if (dir == NULL) {
+        return -1;
+    }
+    struct dirent *dp;
+    char child[MAX_PATH_LENGTH * 2];
+    while ((dp = readdir(dir)) != NULL) {
+        if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0) {
+            continue;
+        }
+        snprintf(child, sizeof(child), "%s/%s", full_path, dp->d_name);
+        if (delete_path(child) < 0) {
+            closedir(dir);
+            return -1;
+        }
+    }
+    closedir(dir);
+    return rmdir(full_path);
+}
+
+// Send a plain file from offset as READ responses of up to READ_PIECE_SIZE
+// bytes on one connection, so a long read doesn't pay for a connection per
+// piece. The last response, short or empty, has more = 0. Sequential
+// fread leaves read-ahead to the kernel.
+void stream_plain_file(int client_sock, const char *full_path, long offset, int accept) {
+    Message response;
+    memset(&response, 0, sizeof(response));
+    response.type = MSG_SS_RESPONSE;
+    FILE *file = fopen(full_path, "rb");
+    if (file == NULL || fseek(file, offset, SEEK_SET) < 0) {
+        if (file != NULL) {
+            fclose(file);
+        }
+        response.type = MSG_ERROR;
+        strcpy(response.payload, "File not found\n");
+        send_text_message(client_sock, &response);
         return;
     }
-    if (connect(nm_sock, (struct sockaddr *)&nm_addr, sizeof(nm_addr)) < 0) {
-        perror("Connection to Naming Server failed");
+    char *raw = malloc(READ_PIECE_SIZE);
+    if (raw == NULL) {
+        fclose(file);
         return;
     }
-    // Prepare file list update message
+    do {
+        int len = fread(raw, 1, READ_PIECE_SIZE, file);
+        fill_response_payload(&response, raw, len, accept);
+        response.more = len == READ_PIECE_SIZE;
+        if (send_message(client_sock, &response) < 0) {
+            break; // Reader went away
+        }
+    } while (response.more);
+    free(raw);
+    fclose(file);
+}
+
+// Logical metadata of a stored path: compressed files report their raw
+// length and chunk manifests the total of their chunks.
+// Returns -1 if the path is missing or not a regular file or directory.
+int stat_stored_file(const char *full_path, FileStat *st) {
+    struct stat statbuf;
+    if (stat(full_path, &statbuf) < 0 ||
+        (!S_ISREG(statbuf.st_mode) && !S_ISDIR(statbuf.st_mode))) {
+        return -1;
+    }
+    st->mtime = statbuf.st_mtime;
+    st->is_dir = S_ISDIR(statbuf.st_mode);
+    st->size = st->is_dir ? 0 : statbuf.st_size;
+    if (st->is_dir) {
+        return 0;
+    }
+
+    ChunkRef refs[MAX_CHUNKS];
+    int count = read_manifest(full_path, refs, MAX_CHUNKS);
+    if (count >= 0) {
+        st->size = 0;
+        for (int i = 0; i < count; i++) {
+            st->size += refs[i].len;
+        }
+        return 0;
+    }
+    FILE *file = fopen(full_path, "rb");
+    if (file != NULL) {
+        StoredFileHeader hdr;
+        if (fread(&hdr, 1, sizeof(hdr), file) == sizeof(hdr) &&
+            memcmp(hdr.magic, STORED_MAGIC, sizeof(hdr.magic)) == 0) {
+            st->size = hdr.raw_len;
+        }
+        fclose(file);
+    }
+    return 0;
+}
+
+// Send the lines collected so far as one MSG_FILE_LIST_UPDATE frame and
+// start the next. more marks that further frames of the same list follow.
+// Returns 0 on success, -1 if the send failed.
+int flush_file_list(int nm_sock, SSFileListUpdate *file_update, size_t *used, int more) {
     Message msg;
+    memset(&msg, 0, MESSAGE_HEADER_SIZE);
     msg.type = MSG_FILE_LIST_UPDATE;
+    msg.more = more;
+    msg.payload_len = offsetof(SSFileListUpdate, file_paths) + *used;
+    memcpy(msg.payload, file_update, msg.payload_len);
+    file_update->file_count = 0;
+    *used = 0;
+    return send_message(nm_sock, &msg);
+}
+
+// Add a line for every path under rel_dir ("" for base_dir itself),
+// subdirectories included, flushing a frame whenever one fills up.
+// Returns 0 once everything is listed, 1 if a directory couldn't be read
+// (the list is then incomplete), or -1 if a send failed.
+int append_file_list(const char *rel_dir, int nm_sock, SSFileListUpdate *file_update,
+                     size_t *used) {
+    char dirpath[MAX_PATH_LENGTH * 2];
+    snprintf(dirpath, sizeof(dirpath), "%s%s", base_dir, rel_dir);
+    DIR *dir = opendir(dirpath);
+    if (dir == NULL) {
+        perror("Failed to open directory");
+        return 1;
+    }
+    int rc = 0;
+    struct dirent *dp;
+    char rel_path[MAX_PATH_LENGTH];
+    char filepath[MAX_PATH_LENGTH * 2];
+    char line[MAX_PATH_LENGTH + 64];
+    while ((dp = readdir(dir)) != NULL) {
+        if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0 ||
+            strcmp(dp->d_name, CHUNK_DIR) == 0) {
+            continue;
+        }
+        if (snprintf(rel_path, sizeof(rel_path), "%s/%s", rel_dir, dp->d_name) >=
+            (int)sizeof(rel_path)) {
+            continue; // Too long for the protocol
+        }
+        snprintf(filepath, sizeof(filepath), "%s%s", base_dir, rel_path);
+        FileStat st;
+        if (stat_stored_file(filepath, &st) < 0) {
+            continue;
+        }
+        int n = snprintf(line, sizeof(line), "%s\t%ld\t%ld\t%d\n",
+                         rel_path, st.size, st.mtime, st.is_dir);
+        if (*used + n >= sizeof(file_update->file_paths) &&
+            flush_file_list(nm_sock, file_update, used, 1) < 0) {
+            rc = -1;
+            break;
+        }
+        memcpy(file_update->file_paths + *used, line, n);
+        *used += n;
+        file_update->file_count++;
+        if (st.is_dir) {
+            int sub = append_file_list(rel_path, nm_sock, file_update, used);
+            if (sub < 0) {
+                rc = -1;
+                break;
+            }
+            if (sub > 0) {
+                rc = 1;
+            }
+        }
+    }
+    closedir(dir);
+    return rc;
+}
+
+// Send the file list with each file's metadata, as many frames as it
+// takes. Used right after the registration ack and for heartbeats.
+void send_file_list(int nm_sock) {
     SSFileListUpdate file_update;
-    file_update.file_count = 0; // Not used in this example
-    strcpy(file_update.file_paths, file_paths);
-    memcpy(msg.payload, &file_update, sizeof(SSFileListUpdate));
-    send(nm_sock, &msg, sizeof(msg), 0);
-    close(nm_sock);
+    memset(&file_update, 0, sizeof(file_update));
+    file_update.ss_info = local_info;
+    size_t used = 0;
+    int rc = append_file_list("", nm_sock, &file_update, &used);
+    if (rc >= 0) {
+        // Only the last frame says whether the list was complete
+        file_update.complete = rc == 0;
+        flush_file_list(nm_sock, &file_update, &used, 0);
+    }
+}
+
+// Periodically refresh every naming server's view of our files
+void *send_heartbeats(void *arg) {
+    while (1) {
+        sleep(HEARTBEAT_INTERVAL);
+        for (int i = 0; i < shard_map.shard_count; i++) {
+            int nm_sock = connect_to_server(shard_map.shards[i].ip_address,
+                                            shard_map.shards[i].port);
+            if (nm_sock >= 0) {
+                send_file_list(nm_sock);
+                close(nm_sock);
+            }
+        }
+        if (storage_backend == BACKEND_CHUNKED) {
+            sweep_chunks();
+        }
+    }
+    return NULL;
 }
 
 void *handle_client(void *arg) {
@@ -72,8 +611,7 @@ void *handle_client(void *arg) {
 	free(arg);
 
 	Message msg;
-	int bytes_read = recv(client_sock, &msg, sizeof(msg), 0);
-	if (bytes_read <= 0) {
+	if (recv_message(client_sock, &msg) < 0) {
 		close(client_sock);
 		pthread_exit(NULL);
 	}
@@ -86,35 +624,147 @@ void *handle_client(void *arg) {
 			   ss_req.command, ss_req.path);
 
 		Message ss_response;
+		memset(&ss_response, 0, MESSAGE_HEADER_SIZE);
 		ss_response.type = MSG_SS_RESPONSE;
+		ss_response.compression = COMP_NONE;
 
 		// Prepend base directory to path
 		char full_path[MAX_PATH_LENGTH * 2];
 		snprintf(full_path, sizeof(full_path), "%s%s", base_dir, ss_req.path);
 
-		if (strcmp(ss_req.command, "READ") == 0) {
-			// Read file content
-			FILE *file = fopen(full_path, "r");
-			if (file == NULL) {
+		int stream = 0;
+		int chunked_len = -1;
+		char chunked_raw[MAX_DATA_SIZE];
+		if (storage_backend == BACKEND_CHUNKED) {
+			// Keep the sweep from removing chunks this request reads or reuses
+			pthread_rwlock_rdlock(&chunk_lock);
+		}
+		if (storage_backend == BACKEND_CHUNKED && strcmp(ss_req.command, "READ") == 0) {
+			chunked_len = read_chunked_file(full_path, chunked_raw, sizeof(chunked_raw));
+		}
+
+		if (strcmp(ss_req.command, "READ") == 0 && ss_req.offset < 0) {
+			ss_response.type = MSG_ERROR;
+			strcpy(ss_response.payload, "Invalid offset\n");
+		} else if (chunked_len >= 0) {
+			chunked_len = slice_from(chunked_raw, chunked_len, ss_req.offset);
+			fill_response_payload(&ss_response, chunked_raw, chunked_len,
+								  ss_req.accept_compression);
+		} else if (chunked_len == -2) {
+			ss_response.type = MSG_ERROR;
+			strcpy(ss_response.payload, "Stored file is corrupt\n");
+		} else if (strcmp(ss_req.command, "READ") == 0) {
+			// Flat file (or a plain file left from before the chunked backend)
+			char stored[MAX_PAYLOAD_SIZE];
+			StoredFileHeader hdr;
+			int len = read_stored_file(full_path, stored, sizeof(stored), &hdr, ss_req.offset);
+			if (len < 0) {
 				ss_response.type = MSG_ERROR;
 				strcpy(ss_response.payload, "File not found\n");
+			} else if (hdr.compression == COMP_NONE) {
+				// Plain file: streamed from the offset after the switch
+				stream = 1;
+			} else if (hdr.compression == ss_req.accept_compression && ss_req.offset == 0) {
+				// Client decodes the codec the file is stored in: send as is
+				memcpy(ss_response.payload, stored, len);
+				ss_response.compression = hdr.compression;
+				ss_response.payload_len = len;
 			} else {
-				memset(ss_response.payload, 0, MAX_DATA_SIZE);
-				fread(ss_response.payload, 1, MAX_DATA_SIZE, file);
-				fclose(file);
+				char raw[MAX_DATA_SIZE];
+				int raw_len = decompress_block(hdr.compression, stored, len, raw, sizeof(raw));
+				if (raw_len < 0) {
+					ss_response.type = MSG_ERROR;
+					strcpy(ss_response.payload, "Stored file is corrupt\n");
+				} else {
+					raw_len = slice_from(raw, raw_len, ss_req.offset);
+					fill_response_payload(&ss_response, raw, raw_len,
+										  ss_req.accept_compression);
+				}
 			}
 		} else if (strcmp(ss_req.command, "WRITE") == 0) {
-			// Write data to file
-			FILE *file = fopen(full_path, "w");
-			if (file == NULL) {
+			// Decode request data; plain data is a string
+			char raw[MAX_DATA_SIZE];
+			int raw_len = -1;
+			if (ss_req.compression == COMP_NONE) {
+				raw_len = decompress_block(COMP_NONE, ss_req.data,
+										   strnlen(ss_req.data, MAX_DATA_SIZE - 1),
+										   raw, MAX_DATA_SIZE - 1);
+			} else if (ss_req.data_len > 0 && ss_req.data_len <= MAX_DATA_SIZE) {
+				raw_len = decompress_block(ss_req.compression, ss_req.data,
+										   ss_req.data_len, raw, MAX_DATA_SIZE - 1);
+			}
+			if (raw_len < 0) {
 				ss_response.type = MSG_ERROR;
-				strcpy(ss_response.payload, "Failed to open file for writing\n");
+				strcpy(ss_response.payload, "Invalid write data\n");
+			} else {
+				raw[raw_len++] = '\n';
+				int rc = storage_backend == BACKEND_CHUNKED ?
+					write_chunked_file(full_path, raw, raw_len) :
+					write_stored_file(full_path, raw, raw_len);
+				if (rc < 0) {
+					ss_response.type = MSG_ERROR;
+					strcpy(ss_response.payload, "Failed to open file for writing\n");
+				} else {
+					strcpy(ss_response.payload, "Write successful\n");
+					stat_stored_file(full_path, &ss_response.stat);
+				}
+			}
+		} else if (storage_backend == BACKEND_CHUNKED &&
+				   strcmp(ss_req.command, "CHUNKS") == 0) {
+			// Report which of the given chunk hashes are stored: '1' present, '0' missing
+			int count = ss_req.data_len / CHUNK_HASH_SIZE;
+			if (ss_req.data_len % CHUNK_HASH_SIZE != 0 || count <= 0 || count > MAX_CHUNKS) {
+				ss_response.type = MSG_ERROR;
+				strcpy(ss_response.payload, "Invalid chunk list\n");
+			} else {
+				for (int i = 0; i < count; i++) {
+					unsigned char *hash = (unsigned char *)ss_req.data + i * CHUNK_HASH_SIZE;
+					ss_response.payload[i] = have_chunk(hash) ? '1' : '0';
+				}
+				ss_response.payload[count] = '\0';
+			}
+		} else if (storage_backend == BACKEND_CHUNKED &&
+				   strcmp(ss_req.command, "WRITE_CHUNKS") == 0) {
+			const char *error = write_chunks_request(full_path, &ss_req);
+			if (error != NULL) {
+				ss_response.type = MSG_ERROR;
+				strcpy(ss_response.payload, error);
 			} else {
-				ss_req.data[strlen(ss_req.data)] = '\n';
-				ss_req.data[MAX_DATA_SIZE - 1] = '\0';
-				fwrite(ss_req.data, 1, strlen(ss_req.data), file);
-				fclose(file);
 				strcpy(ss_response.payload, "Write successful\n");
+				stat_stored_file(full_path, &ss_response.stat);
+			}
+		} else if (strcmp(ss_req.command, "DELETE") == 0) {
+			// Never the base directory itself
+			if (strcmp(ss_req.path, "/") == 0 || delete_path(full_path) != 0) {
+				ss_response.type = MSG_ERROR;
+				strcpy(ss_response.payload, "Failed to delete\n");
+			} else {
+				strcpy(ss_response.payload, "Delete successful\n");
+			}
+		} else if (strcmp(ss_req.command, "RENAME") == 0) {
+			// New path in data. Only the directory entry changes: the file's
+			// content, chunks or compression header stay where they are.
+			char new_path[MAX_PATH_LENGTH];
+			char new_full_path[MAX_PATH_LENGTH * 2];
+			snprintf(new_path, sizeof(new_path), "%.*s", MAX_PATH_LENGTH - 1, ss_req.data);
+			snprintf(new_full_path, sizeof(new_full_path), "%s%s", base_dir, new_path);
+			if (new_path[0] != '/') {
+				ss_response.type = MSG_ERROR;
+				strcpy(ss_response.payload, "Invalid new path\n");
+			} else if (rename(full_path, new_full_path) < 0) {
+				ss_response.type = MSG_ERROR;
+				strcpy(ss_response.payload, "Failed to rename\n");
+			} else {
+				strcpy(ss_response.payload, "Rename successful\n");
+				stat_stored_file(new_full_path, &ss_response.stat);
+			}
+		} else if (strcmp(ss_req.command, "MKDIR") == 0) {
+			if (mkdir(full_path, 0755) < 0) {
+				ss_response.type = MSG_ERROR;
+				strcpy(ss_response.payload, "Failed to create directory\n");
+			} else {
+				strcpy(ss_response.payload, "Directory created\n");
+				stat_stored_file(full_path, &ss_response.stat);
 			}
 		} else if (strcmp(ss_req.command, "LIST") == 0) {
 			// List directory contents
@@ -126,6 +776,12 @@ void *handle_client(void *arg) {
 				struct dirent *dp;
 				char buffer[MAX_DATA_SIZE] = {0};
 				while ((dp = readdir(dir)) != NULL) {
+					if (strcmp(dp->d_name, CHUNK_DIR) == 0) {
+						continue;
+					}
+					if (strlen(buffer) + strlen(dp->d_name) + 2 > sizeof(buffer)) {
+						break; // Buffer full: the listing is cut short
+					}
 					strcat(buffer, dp->d_name);
 					strcat(buffer, "\n");
 				}
@@ -137,24 +793,32 @@ void *handle_client(void *arg) {
 			strcpy(ss_response.payload, "Unknown command\n");
 		}
 
-		send(client_sock, &ss_response, sizeof(ss_response), 0);
+		if (storage_backend == BACKEND_CHUNKED) {
+			// Overwriting, deleting or renaming over a file can orphan chunks
+			if (ss_response.type != MSG_ERROR &&
+				(strcmp(ss_req.command, "WRITE") == 0 ||
+				 strcmp(ss_req.command, "WRITE_CHUNKS") == 0 ||
+				 strcmp(ss_req.command, "DELETE") == 0 ||
+				 strcmp(ss_req.command, "RENAME") == 0)) {
+				chunks_dirty = 1;
+			}
+			pthread_rwlock_unlock(&chunk_lock);
+		}
+
+		if (stream) {
+			stream_plain_file(client_sock, full_path, ss_req.offset, ss_req.accept_compression);
+		} else if (strcmp(ss_req.command, "READ") == 0 && ss_response.type != MSG_ERROR) {
+			send_message(client_sock, &ss_response); // payload_len set with the data
+		} else {
+			send_text_message(client_sock, &ss_response);
+		}
 	}
 
 	close(client_sock);
 	pthread_exit(NULL);
 }
 
-int main(int argc, char *argv[]) {
-	if (argc < 4) {
-		printf("Usage: %s <NM_IP> <SS_Port> <Base_Directory>\n", argv[0]);
-		return -1;
-	}
-
-	char *nm_ip = argv[1];
-	int ss_port = atoi(argv[2]);
-	strcpy(base_dir, argv[3]);
-
-	// Register with Naming Server
+int register_with_naming_server(const char *nm_ip, int nm_port, SSRegisterInfo ss_info) {
 	int nm_sock;
 	struct sockaddr_in nm_addr;
 
@@ -164,48 +828,119 @@ int main(int argc, char *argv[]) {
 	}
 
 	nm_addr.sin_family = AF_INET;
-	nm_addr.sin_port = htons(NM_PORT);
+	nm_addr.sin_port = htons(nm_port);
 
 	if (inet_pton(AF_INET, nm_ip, &nm_addr.sin_addr) <= 0) {
 		perror("Invalid Naming Server IP");
+		close(nm_sock);
 		return -1;
 	}
 
 	if (connect(nm_sock, (struct sockaddr *)&nm_addr, sizeof(nm_addr)) < 0) {
 		perror("Connection to Naming Server failed");
+		close(nm_sock);
 		return -1;
 	}
 
 	// Prepare registration message
 	Message reg_msg;
+	memset(&reg_msg, 0, MESSAGE_HEADER_SIZE);
 	reg_msg.type = MSG_REGISTER_SS;
-
-	SSRegisterInfo ss_info;
-	// Get local IP address
-	char ss_ip[16];
-	// Assuming localhost for example
-	strcpy(ss_ip, "127.0.0.1");
-	strcpy(ss_info.ip_address, ss_ip);
-	ss_info.port = ss_port;
-
 	memcpy(reg_msg.payload, &ss_info, sizeof(SSRegisterInfo));
-	send(nm_sock, &reg_msg, sizeof(reg_msg), 0);
+	reg_msg.payload_len = sizeof(SSRegisterInfo);
+	send_message(nm_sock, &reg_msg);
 
 	// Wait for acknowledgment
 	Message ack_msg;
-	int bytes_read = recv(nm_sock, &ack_msg, sizeof(ack_msg), 0);
-	if (bytes_read > 0 && ack_msg.type == MSG_REGISTER_ACK) {
-		printf("Registered with Naming Server\n");
+	if (recv_message(nm_sock, &ack_msg) == 0 && ack_msg.type == MSG_REGISTER_ACK) {
+		printf("Registered with Naming Server %s:%d\n", nm_ip, nm_port);
 	} else {
-		printf("Failed to register with Naming Server\n");
+		printf("Failed to register with Naming Server %s:%d\n", nm_ip, nm_port);
 		close(nm_sock);
 		return -1;
 	}
 
 	// Send file list to naming server
-    send_file_list(nm_ip, NM_PORT, ss_info);
+	send_file_list(nm_sock);
 
 	close(nm_sock);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 4) {
+		printf("Usage: %s <NM_IP[:NM_Port]> <SS_Port> <Base_Directory> [none|lz4|zlib] [flat|chunked]\n",
+			   argv[0]);
+		return -1;
+	}
+
+	// Any naming server shard; the rest come from its shard map
+	NamingServerInfo nm_info;
+	if (strchr(argv[1], ':') == NULL) {
+		snprintf(nm_info.ip_address, sizeof(nm_info.ip_address), "%s", argv[1]);
+		nm_info.port = NM_PORT;
+	} else if (parse_address(argv[1], &nm_info) < 0) {
+		printf("Invalid Naming Server address: %s\n", argv[1]);
+		return -1;
+	}
+	char *nm_ip = nm_info.ip_address;
+	int nm_port = nm_info.port;
+	int ss_port = atoi(argv[2]);
+	strcpy(base_dir, argv[3]);
+	if (argc > 4) {
+		int comp = compression_from_name(argv[4]);
+		if (comp < 0) {
+			printf("Unknown compression: %s\n", argv[4]);
+			return -1;
+		}
+		store_compression = comp;
+	}
+	if (argc > 5) {
+		if (strcmp(argv[5], "chunked") == 0) {
+			storage_backend = BACKEND_CHUNKED;
+		} else if (strcmp(argv[5], "flat") != 0) {
+			printf("Unknown storage backend: %s\n", argv[5]);
+			return -1;
+		}
+	}
+	if (storage_backend == BACKEND_CHUNKED) {
+		char chunk_dir[MAX_PATH_LENGTH * 2];
+		snprintf(chunk_dir, sizeof(chunk_dir), "%s/%s", base_dir, CHUNK_DIR);
+		if (mkdir(chunk_dir, 0755) < 0 && errno != EEXIST) {
+			perror("Failed to create chunk directory");
+			return -1;
+		}
+	}
+
+	SSRegisterInfo ss_info;
+	// Get local IP address
+	char ss_ip[16];
+	// Assuming localhost for example
+	strcpy(ss_ip, "127.0.0.1");
+	strcpy(ss_info.ip_address, ss_ip);
+	ss_info.port = ss_port;
+	ss_info.features = storage_backend == BACKEND_CHUNKED ? SS_FEATURE_CHUNK_STORE : 0;
+	local_info = ss_info;
+
+	// Register with every naming server shard (or the single naming server)
+	if (fetch_shard_map(nm_ip, nm_port, &shard_map) < 0 || shard_map.shard_count == 1) {
+		shard_map.shard_count = 1;
+		strcpy(shard_map.shards[0].ip_address, nm_ip);
+		shard_map.shards[0].port = nm_port;
+	}
+	for (int i = 0; i < shard_map.shard_count; i++) {
+		if (register_with_naming_server(shard_map.shards[i].ip_address,
+										shard_map.shards[i].port, ss_info) < 0) {
+			return -1;
+		}
+	}
+
+	pthread_t heartbeat_thread;
+	if (pthread_create(&heartbeat_thread, NULL, send_heartbeats, NULL) != 0) {
+		perror("Could not create heartbeat thread");
+	} else {
+		pthread_detach(heartbeat_thread);
+	}
 
 	// Start listening for client connections
 	int server_fd, *new_sock;